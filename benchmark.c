@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "custom_unistd.h"
+
+#define DEFAULT_OPS     1000000
+#define MAX_THREADS     64
+#define LIVE_SLOTS      1024    // Obiekty utrzymywane przy życiu w pętlach alokacji
+#define CHURN_SLOTS     20000   // Obiekty utrzymywane przy życiu w teście fragmentacji
+#define RING_SIZE       4096    // Kolejka producent-konsument
+#define SAMPLE_EVERY    4096    // Co tyle operacji próbkowany jest rozmiar sterty
+#define REALLOC_LIMIT   (1024 * 1024)
+#define RESERVE_SLACK   2       // Zapas rezerwacji sterty na nagłówki i fragmentację
+
+// Testowany alokator
+struct allocator {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*release)(void *);
+    void *(*resize)(void *, size_t);
+    size_t (*heap_size)(void);
+    int (*reset)(void);     //0 - alokator gotowy do pomiaru
+};
+
+// Rozkład rozmiarów
+struct size_dist {
+    const char *name;
+    size_t min;
+    size_t max;
+};
+
+// Czasy pojedynczych operacji jednego wątku, w pamięci spoza testowanych alokatorów
+struct samples {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+    size_t peak_heap;
+};
+
+struct worker {
+    const struct allocator *allocator;
+    const struct size_dist *dist;
+    struct samples samples;
+    size_t ops;
+    size_t failed;          //alokacje, które zwróciły NULL
+    uint64_t seed;
+    bool sample_heap;
+};
+
+// Kolejka jednego producenta i jednego konsumenta
+struct ring {
+    void *slots[RING_SIZE];
+    size_t head;
+    size_t tail;
+};
+
+static const struct size_dist dist_small = { "16-256 B", 16, 256 };
+static const struct size_dist dist_medium = { "256 B-4 KB", 256, 4096 };
+static const struct size_dist dist_large = { "4-256 KB", 4096, 256 * 1024 };
+static const struct size_dist dist_mixed = { "mixed", 0, 0 };  //80% małych, 15% średnich, 5% dużych
+static const struct size_dist dist_churn = { "16 B-16 KB", 16, 16384 };
+
+static size_t heap_reserve;     //rezerwacja sterty heap_* na największe obciążenie
+static int invalid_runs;        //przebiegi z nieudanymi alokacjami
+
+static size_t custom_heap_size(void) {
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.used_space + stats.free_space;
+}
+
+static int custom_reset(void) {
+    heap_mallopt(HEAP_M_HUGE_PAGES, 0);
+    return heap_setup_reserve(heap_reserve);
+}
+
+static int huge_reset(void) {
+    heap_mallopt(HEAP_M_HUGE_PAGES, 1);
+    return heap_setup_reserve(heap_reserve);
+}
+
+static size_t system_heap_size(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static int system_reset(void) {
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+    return 0;
+}
+
+static const struct allocator allocators[] = {
+    { "heap_*", heap_malloc, heap_free, heap_realloc, custom_heap_size, custom_reset },
+    { "heap_thp", heap_malloc, heap_free, heap_realloc, custom_heap_size, huge_reset },
+    { "system", malloc, free, realloc, system_heap_size, system_reset },
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    //XORSHIFT, EVERY THREAD HAS ITS OWN STATE
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static size_t random_size(const struct size_dist *dist, uint64_t *state) {
+    if(dist == &dist_mixed) {
+        uint64_t pick = next_random(state) % 100;
+        dist = pick < 80 ? &dist_small : pick < 95 ? &dist_medium : &dist_large;
+    }
+    return dist->min + next_random(state) % (dist->max - dist->min + 1);
+}
+
+static bool samples_init(struct samples *samples, size_t capacity) {
+    samples->ns = mmap(NULL, capacity * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    samples->count = 0;
+    samples->capacity = capacity;
+    samples->peak_heap = 0;
+    return samples->ns != MAP_FAILED;
+}
+
+static void samples_free(struct samples *samples) {
+    munmap(samples->ns, samples->capacity * sizeof(uint64_t));
+}
+
+static void samples_add(struct samples *samples, uint64_t ns) {
+    if(samples->count < samples->capacity)
+        samples->ns[samples->count++] = ns;
+}
+
+static void samples_heap(struct samples *samples, const struct allocator *allocator) {
+    size_t size = allocator->heap_size();
+    if(size > samples->peak_heap)
+        samples->peak_heap = size;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct samples *samples, double fraction) {
+    if(!samples->count)
+        return 0;
+    return samples->ns[(size_t)(fraction * (samples->count - 1))];
+}
+
+//
+// PEAK RSS, RESET THROUGH /proc/self/clear_refs WHERE THE KERNEL ALLOWS IT
+//
+
+static void rss_reset(void) {
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if(!file)
+        return;
+    fputs("5", file);
+    fclose(file);
+}
+
+static size_t rss_peak_kb(void) {
+    FILE *file = fopen("/proc/self/status", "r");
+    if(!file)
+        return 0;
+    char line[256];
+    size_t peak = 0;
+    while(fgets(line, sizeof(line), file))
+        if(sscanf(line, "VmHWM: %zu kB", &peak) == 1)
+            break;
+    fclose(file);
+    return peak;
+}
+
+//
+// dTLB LOAD MISSES OF THE WHOLE RUN, THREADS INHERIT THE COUNTER
+//
+
+static int tlb_fd = -1;
+
+static void tlb_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    tlb_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void tlb_start(void) {
+    if(tlb_fd < 0)
+        return;
+    ioctl(tlb_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static int64_t tlb_stop(void) {
+    //-1 - NO COUNTER (NO PMU OR perf_event_paranoid)
+    uint64_t count;
+    if(tlb_fd < 0)
+        return -1;
+    ioctl(tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(tlb_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+static void report(const char *workload, const struct allocator *allocator, struct samples *samples, size_t ops, uint64_t elapsed, int64_t tlb_misses, size_t failed) {
+    char misses[32] = "n/a";
+    if(tlb_misses >= 0)
+        snprintf(misses, sizeof(misses), "%lld", (long long)tlb_misses);
+    qsort(samples->ns, samples->count, sizeof(uint64_t), compare_ns);
+    printf("%-28s %-8s %12.0f ops/s  p50 %6.0f ns  p99 %7.0f ns  p999 %8.0f ns  peak RSS %7zu KB  peak heap %7zu KB  dTLB misses %10s\n",
+        workload, allocator->name, ops / (elapsed / 1e9),
+        percentile(samples, 0.5), percentile(samples, 0.99), percentile(samples, 0.999),
+        rss_peak_kb(), samples->peak_heap / 1024, misses);
+    if(failed) { //skipped operations make it a smaller workload than the other allocators ran
+        printf("%-28s %-8s INVALID: %zu allocations failed\n", workload, allocator->name, failed);
+        ++invalid_runs;
+    }
+}
+
+//
+// WORKLOADS, EACH RUN BY ONE OR MORE worker THREADS
+//
+
+static void *loop_worker(void *arg) {
+    //RANDOM SLOT: FREE IT WHEN TAKEN, FILL IT OTHERWISE
+    struct worker *worker = arg;
+    const struct allocator *allocator = worker->allocator;
+    void *live[LIVE_SLOTS] = { NULL };
+    for(size_t i = 0; i < worker->ops; ++i) {
+        size_t slot = next_random(&worker->seed) % LIVE_SLOTS;
+        uint64_t start;
+        if(live[slot]) {
+            start = now_ns();
+            allocator->release(live[slot]);
+            samples_add(&worker->samples, now_ns() - start);
+            live[slot] = NULL;
+        }
+        else {
+            size_t size = random_size(worker->dist, &worker->seed);
+            start = now_ns();
+            live[slot] = allocator->alloc(size);
+            samples_add(&worker->samples, now_ns() - start);
+            if(live[slot])
+                *(char *)live[slot] = 1;
+            else
+                ++worker->failed;
+        }
+        if(worker->sample_heap && i % SAMPLE_EVERY == 0)
+            samples_heap(&worker->samples, allocator);
+    }
+    for(size_t slot = 0; slot < LIVE_SLOTS; ++slot)
+        if(live[slot])
+            allocator->release(live[slot]);
+    return NULL;
+}
+
+struct pipe_worker {
+    struct worker worker;
+    struct ring *ring;
+};
+
+static void *producer_worker(void *arg) {
+    struct pipe_worker *pipe = arg;
+    struct worker *worker = &pipe->worker;
+    for(size_t i = 0; i < worker->ops; ++i) {
+        size_t size = random_size(worker->dist, &worker->seed);
+        uint64_t start = now_ns();
+        void *ptr = worker->allocator->alloc(size);
+        samples_add(&worker->samples, now_ns() - start);
+        if(ptr)
+            *(char *)ptr = 1;
+        else //a NULL still goes through the ring, the consumer counts it as an operation
+            ++worker->failed;
+        while(__atomic_load_n(&pipe->ring->head, __ATOMIC_ACQUIRE) - pipe->ring->tail >= RING_SIZE)
+            sched_yield();
+        pipe->ring->slots[pipe->ring->tail % RING_SIZE] = ptr;
+        __atomic_store_n(&pipe->ring->tail, pipe->ring->tail + 1, __ATOMIC_RELEASE);
+        if(worker->sample_heap && i % SAMPLE_EVERY == 0)
+            samples_heap(&worker->samples, worker->allocator);
+    }
+    return NULL;
+}
+
+static void *consumer_worker(void *arg) {
+    struct pipe_worker *pipe = arg;
+    struct worker *worker = &pipe->worker;
+    for(size_t i = 0; i < worker->ops; ++i) {
+        while(__atomic_load_n(&pipe->ring->tail, __ATOMIC_ACQUIRE) == pipe->ring->head)
+            sched_yield();
+        void *ptr = pipe->ring->slots[pipe->ring->head % RING_SIZE];
+        __atomic_store_n(&pipe->ring->head, pipe->ring->head + 1, __ATOMIC_RELEASE);
+        uint64_t start = now_ns();
+        worker->allocator->release(ptr);
+        samples_add(&worker->samples, now_ns() - start);
+    }
+    return NULL;
+}
+
+static void *realloc_worker(void *arg) {
+    //BUFFERS GROW 1.5x FROM 16 B TO 1 MB, LIKE A GROWING VECTOR
+    struct worker *worker = arg;
+    const struct allocator *allocator = worker->allocator;
+    size_t done = 0;
+    while(done < worker->ops) {
+        size_t size = 16;
+        char *ptr = allocator->alloc(size);
+        if(!ptr)
+            ++worker->failed;
+        while(size < REALLOC_LIMIT && done < worker->ops) {
+            size += size / 2 + 16;
+            uint64_t start = now_ns();
+            char *grown = allocator->resize(ptr, size);
+            samples_add(&worker->samples, now_ns() - start);
+            ++done;
+            if(!grown) { //heap exhausted, the old buffer is still valid
+                ++worker->failed;
+                break;
+            }
+            ptr = grown;
+            ptr[size - 1] = 1;
+        }
+        allocator->release(ptr);
+        if(worker->sample_heap)
+            samples_heap(&worker->samples, allocator);
+    }
+    return NULL;
+}
+
+static void *churn_worker(void *arg) {
+    //MANY LIVE OBJECTS, EACH STEP REPLACES ONE WITH A NEW RANDOM SIZE
+    struct worker *worker = arg;
+    const struct allocator *allocator = worker->allocator;
+    void **live = mmap(NULL, CHURN_SLOTS * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(live == MAP_FAILED)
+        return NULL;
+    for(size_t slot = 0; slot < CHURN_SLOTS; ++slot)
+        if(!(live[slot] = allocator->alloc(random_size(worker->dist, &worker->seed))))
+            ++worker->failed;
+    for(size_t i = 0; i < worker->ops; i += 2) {
+        size_t slot = next_random(&worker->seed) % CHURN_SLOTS;
+        size_t size = random_size(worker->dist, &worker->seed);
+        uint64_t start = now_ns();
+        allocator->release(live[slot]);
+        uint64_t middle = now_ns();
+        live[slot] = allocator->alloc(size);
+        samples_add(&worker->samples, middle - start);
+        samples_add(&worker->samples, now_ns() - middle);
+        if(live[slot])
+            *(char *)live[slot] = 1;
+        else
+            ++worker->failed;
+        if(i % SAMPLE_EVERY == 0)
+            samples_heap(&worker->samples, allocator);
+    }
+    samples_heap(&worker->samples, allocator);
+    for(size_t slot = 0; slot < CHURN_SLOTS; ++slot)
+        allocator->release(live[slot]);
+    munmap(live, CHURN_SLOTS * sizeof(void *));
+    return NULL;
+}
+
+static void *access_worker(void *arg) {
+    //MANY LIVE OBJECTS READ AT RANDOM, THE COST IS IN THE TLB RATHER THAN THE ALLOCATOR
+    struct worker *worker = arg;
+    const struct allocator *allocator = worker->allocator;
+    void **live = mmap(NULL, CHURN_SLOTS * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t *sizes = mmap(NULL, CHURN_SLOTS * sizeof(size_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(live == MAP_FAILED || sizes == MAP_FAILED) {
+        if(live != MAP_FAILED)
+            munmap(live, CHURN_SLOTS * sizeof(void *));
+        if(sizes != MAP_FAILED)
+            munmap(sizes, CHURN_SLOTS * sizeof(size_t));
+        return NULL;
+    }
+    for(size_t slot = 0; slot < CHURN_SLOTS; ++slot) {
+        sizes[slot] = random_size(worker->dist, &worker->seed);
+        live[slot] = allocator->alloc(sizes[slot]);
+        if(live[slot])
+            memset(live[slot], (int)slot, sizes[slot]);
+        else
+            ++worker->failed;
+    }
+    samples_heap(&worker->samples, allocator);
+    volatile char sink = 0;
+    for(size_t i = 0; i < worker->ops; ++i) {
+        size_t slot = next_random(&worker->seed) % CHURN_SLOTS;
+        uint64_t start = now_ns();
+        if(live[slot])
+            sink += ((char *)live[slot])[next_random(&worker->seed) % sizes[slot]];
+        samples_add(&worker->samples, now_ns() - start);
+    }
+    (void)sink;
+    for(size_t slot = 0; slot < CHURN_SLOTS; ++slot)
+        allocator->release(live[slot]);
+    munmap(live, CHURN_SLOTS * sizeof(void *));
+    munmap(sizes, CHURN_SLOTS * sizeof(size_t));
+    return NULL;
+}
+
+//
+// RUNNERS
+//
+
+static bool workers_init(struct worker *workers, int count, const struct allocator *allocator, const struct size_dist *dist, size_t ops) {
+    for(int i = 0; i < count; ++i) {
+        workers[i].allocator = allocator;
+        workers[i].dist = dist;
+        workers[i].ops = ops;
+        workers[i].failed = 0;
+        workers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].sample_heap = i == 0;
+        if(!samples_init(&workers[i].samples, 2 * ops + 16)) {
+            while(i--)
+                samples_free(&workers[i].samples);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void workers_report(const char *workload, struct worker *workers, int count, size_t ops, uint64_t elapsed, int64_t tlb_misses) {
+    //ALL SAMPLES MERGED INTO THE FIRST WORKER
+    struct samples all;
+    size_t total = 0, failed = 0;
+    for(int i = 0; i < count; ++i) {
+        total += workers[i].samples.count;
+        failed += workers[i].failed;
+    }
+    if(!samples_init(&all, total + 1)) {
+        for(int i = 0; i < count; ++i)
+            samples_free(&workers[i].samples);
+        return;
+    }
+    for(int i = 0; i < count; ++i) {
+        memcpy(all.ns + all.count, workers[i].samples.ns, workers[i].samples.count * sizeof(uint64_t));
+        all.count += workers[i].samples.count;
+        if(workers[i].samples.peak_heap > all.peak_heap)
+            all.peak_heap = workers[i].samples.peak_heap;
+        samples_free(&workers[i].samples);
+    }
+    report(workload, workers[0].allocator, &all, ops, elapsed, tlb_misses, failed);
+    samples_free(&all);
+}
+
+static void run_threads(const char *workload, void *(*body)(void *), const struct allocator *allocator, const struct size_dist *dist, size_t ops, int threads) {
+    struct worker workers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    if(allocator->reset() != 0) {
+        printf("%-28s %-8s INVALID: reset failed\n", workload, allocator->name);
+        ++invalid_runs;
+        return;
+    }
+    rss_reset();
+    if(!workers_init(workers, threads, allocator, dist, ops / threads))
+        return;
+    tlb_start();
+    uint64_t start = now_ns();
+    for(int i = 0; i < threads; ++i)
+        pthread_create(&ids[i], NULL, body, &workers[i]);
+    for(int i = 0; i < threads; ++i)
+        pthread_join(ids[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+    int64_t tlb_misses = tlb_stop();
+    samples_heap(&workers[0].samples, allocator);
+    workers_report(workload, workers, threads, ops / threads * threads, elapsed, tlb_misses);
+}
+
+static void run_pipe(const struct allocator *allocator, size_t ops) {
+    //ONE THREAD ALLOCATES, THE OTHER FREES
+    struct pipe_worker pipes[2];
+    struct worker workers[2];
+    pthread_t ids[2];
+    struct ring *ring = mmap(NULL, sizeof(struct ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED)
+        return;
+    ring->head = ring->tail = 0;
+    if(allocator->reset() != 0) {
+        printf("%-28s %-8s INVALID: reset failed\n", "producer/consumer", allocator->name);
+        ++invalid_runs;
+        munmap(ring, sizeof(struct ring));
+        return;
+    }
+    rss_reset();
+    if(!workers_init(workers, 2, allocator, &dist_mixed, ops / 2)) {
+        munmap(ring, sizeof(struct ring));
+        return;
+    }
+    for(int i = 0; i < 2; ++i) {
+        pipes[i].worker = workers[i];
+        pipes[i].ring = ring;
+    }
+    tlb_start();
+    uint64_t start = now_ns();
+    pthread_create(&ids[0], NULL, producer_worker, &pipes[0]);
+    pthread_create(&ids[1], NULL, consumer_worker, &pipes[1]);
+    pthread_join(ids[0], NULL);
+    pthread_join(ids[1], NULL);
+    uint64_t elapsed = now_ns() - start;
+    int64_t tlb_misses = tlb_stop();
+    for(int i = 0; i < 2; ++i)
+        workers[i] = pipes[i].worker;
+    workers_report("producer/consumer", workers, 2, ops / 2 * 2, elapsed, tlb_misses);
+    munmap(ring, sizeof(struct ring));
+}
+
+static size_t workload_reserve(int max_threads) {
+    //LARGEST LIVE SET OF ANY WORKLOAD WITH EVERY SLOT AT ITS LARGEST SIZE
+    size_t live[] = {
+        LIVE_SLOTS * dist_large.max,                            //alloc/free 4-256 KB
+        (size_t)max_threads * LIVE_SLOTS * dist_small.max,      //scaling
+        (RING_SIZE + 1) * dist_large.max,                       //producer/consumer, the ring full
+        2 * REALLOC_LIMIT,                                      //realloc growth, old and new buffer
+        CHURN_SLOTS * dist_churn.max,                           //fragmentation churn
+        CHURN_SLOTS * dist_medium.max,                          //random access
+    };
+    size_t largest = 0;
+    for(size_t i = 0; i < sizeof(live) / sizeof(live[0]); ++i)
+        if(live[i] > largest)
+            largest = live[i];
+    return RESERVE_SLACK * largest;
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_OPS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 2 ? atoi(argv[2]) : (cpus > 1 ? cpus : 4);
+    if(!ops)
+        ops = DEFAULT_OPS;
+    if(max_threads < 1 || max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+    heap_reserve = workload_reserve(max_threads);
+    if(heap_setup_reserve(heap_reserve) != 0) {
+        fprintf(stderr, "heap_setup_reserve(%zu) failed\n", heap_reserve);
+        return 1;
+    }
+    const struct size_dist *dists[] = { &dist_small, &dist_medium, &dist_large, &dist_mixed };
+    char name[64];
+    tlb_open();
+    printf("ops: %zu, threads: 1-%d, heap_* reserve: %zu MB\n", ops, max_threads, heap_reserve >> 20);
+    for(size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); ++d)
+        for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a) {
+            snprintf(name, sizeof(name), "alloc/free %s", dists[d]->name);
+            run_threads(name, loop_worker, &allocators[a], dists[d], ops, 1);
+        }
+    for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+        run_pipe(&allocators[a], ops);
+    for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+        run_threads("realloc growth", realloc_worker, &allocators[a], &dist_small, ops / 10, 1);
+    for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+        run_threads("fragmentation churn", churn_worker, &allocators[a], &dist_churn, ops, 1);
+    for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+        run_threads("random access", access_worker, &allocators[a], &dist_medium, ops, 1);
+    for(int threads = 1; threads <= max_threads; threads *= 2)
+        for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a) {
+            snprintf(name, sizeof(name), "scaling %d threads", threads);
+            run_threads(name, loop_worker, &allocators[a], &dist_small, ops, threads);
+        }
+    if(invalid_runs) {
+        fprintf(stderr, "%d runs invalid, their numbers are not comparable\n", invalid_runs);
+        return 1;
+    }
+    return 0;
+}
@@ -6,8 +6,53 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define HEAP_M_TRIM_THRESHOLD -1
+#define HEAP_M_TOP_PAD        -2
+#define HEAP_M_SHARDS         -3
+#define HEAP_M_HUGE_PAGES     -4
+#define HEAP_M_PROFILE_RATE   -5
+
+struct heap_arena;
+
+struct heap_stats {
+    size_t   used_space;
+    size_t   largest_used_block_size;
+    uint64_t used_blocks_count;
+    size_t   free_space;
+    size_t   largest_free_area;
+    uint64_t free_gaps_count;
+};
+
+#define HEAP_TRACE_MAGIC "HEAPTRC1"
+
+enum heap_trace_op_t {
+    trace_malloc,
+    trace_calloc,
+    trace_realloc,
+    trace_free,
+    trace_reset
+};
+
+struct heap_trace_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct heap_trace_record {
+    uint64_t timestamp;     // ns od początku śladu
+    uint64_t size;          // dla trace_reset rozmiar rezerwacji z heap_setup_reserve
+    uint64_t pointer;       // argument heap_free/heap_realloc
+    uint64_t result;        // zwrócony adres, identyfikuje obiekt do jego zwolnienia
+    uint32_t thread;
+    uint8_t op;
+    uint8_t alignment_log2; // 0 - wyrównanie domyślne
+    uint16_t reserved;
+};
+
 void* custom_sbrk(intptr_t delta);
 int heap_setup(void);
+int heap_setup_reserve(size_t reserve);
 void* heap_malloc(size_t count);
 void* heap_calloc(size_t number, size_t size);
 void  heap_free(void* memblock);
@@ -21,28 +66,54 @@ void* heap_realloc_aligned(void* memblock, size_t size);
 void* heap_malloc_aligned_debug(size_t count, int fileline, const char* filename);
 void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename);
 void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename);
+void* heap_memalign(size_t alignment, size_t count);
+int   heap_posix_memalign(void** memptr, size_t alignment, size_t size);
+size_t heap_malloc_batch(size_t size, size_t n, void** out);
+void   heap_free_batch(void** ptrs, size_t n);
 size_t   heap_get_used_space(void);
 size_t   heap_get_largest_used_block_size(void);
 uint64_t heap_get_used_blocks_count(void);
 size_t   heap_get_free_space(void);
 size_t   heap_get_largest_free_area(void);
 uint64_t heap_get_free_gaps_count(void);
+size_t   heap_get_heap_size(void);
+int   heap_mallopt(int param, int value);
+int   heap_trim(size_t pad);
+void heap_get_stats(struct heap_stats* stats);
+int   heap_trace_start(const char* path);
+void  heap_trace_stop(void);
+int   heap_profile_dump(const char* path);
+struct heap_arena* heap_arena_create(void);
+void* heap_arena_alloc(struct heap_arena* arena, size_t count);
+void  heap_arena_reset(struct heap_arena* arena);
+void  heap_arena_destroy(struct heap_arena* arena);
 enum pointer_type_t get_pointer_type(const void* pointer);
 void* heap_get_data_block_start(const void* pointer);
 size_t heap_get_block_size(const void* memblock);
 int heap_validate(void);
+int heap_validate_step(size_t blocks);
+int heap_validate_start(int percent);
+int heap_validate_stop(void);
 void heap_dump_debug_information(void);
+void heap_dump_call_sites(void);
 
 struct block_meta {
     uint8_t start_fence;
-    bool empty;
-    bool debug;
-    int fileline;
+    union {
+        struct {
+            bool empty : 1;
+            bool mapped : 1;
+        };
+        uint8_t state;      //empty i mapped razem, do odczytu bez blokady shardu
+    };
+    bool : 0;               //debug i sampled zmieniane poza blokadą shardu, w osobnym bajcie
+    bool debug : 1;
+    bool sampled : 1;
+    uint8_t end_fence;
+    uint32_t checksum;      //CRC32C nagłówka bez debug i sampled
     struct block_meta *prev;
     struct block_meta *next;
     size_t size;
-    char filename[31];
-    uint8_t end_fence;
 };
 
 enum pointer_type_t {
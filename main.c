@@ -2,14 +2,56 @@
 #include "custom_unistd.h"
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #define malloc(_size) heap_malloc_debug((_size), __LINE__, __FILE__)
 #define calloc(_number, _size) heap_calloc_debug((_number), (_size), __LINE__, __FILE__)
 #define realloc(_ptr, _size) heap_realloc_debug((_ptr), (_size), __LINE__, __FILE__)
 #define malloc_aligned(_size) heap_malloc_aligned_debug((_size), __LINE__, __FILE__)
 #define calloc_aligned(_number, _size) heap_calloc_aligned_debug((_number), (_size), __LINE__, __FILE__)
 #define realloc_aligned(_ptr, _size) heap_realloc_aligned_debug((_ptr), (_size), __LINE__, __FILE__)
-#define META_SIZE 64
+#define META_SIZE 32
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SCALE_OPS 200000
+#define SCALE_THREADS 8
+#define TCACHE_TEST_OBJECTS 40
+
+extern pthread_mutex_t mut;
+
+void* thread_free_all(void* arg) {
+    void **ptrs = arg;
+    for(int i = 0; i <= TCACHE_TEST_OBJECTS; ++i)
+        heap_free(ptrs[i]);
+    return NULL;
+}
+
+void* thread_profile(void* arg) {
+    void **ptrs = arg;
+    for(int i = 0; i < 20; ++i)
+        ptrs[i] = heap_malloc(i % 2 ? 64 : 1000);
+    for(int i = 0; i < 20; i += 4)
+        heap_free(ptrs[i]);
+    return NULL;
+}
+
+void* thread_profile_aligned(void* arg) {
+    void **ptrs = arg;
+    ptrs[0] = malloc_aligned(100); //bloki debugowe nie sa probkowane w zadnym wariancie
+    ptrs[1] = calloc_aligned(10, 10);
+    ptrs[2] = heap_malloc_aligned(100);
+    return NULL;
+}
+
+void* thread_sampling(void* arg) {
+    int *stop = arg;
+    while(!__atomic_load_n(stop, __ATOMIC_RELAXED))
+        heap_free(heap_malloc(1000)); //probka i jej usuniecie pod sample_mut
+    return NULL;
+}
 
 void* thread_test(void* arg) {
     int num = *(int *)arg;
@@ -35,11 +77,46 @@ void* thread_free(void* arg) {
     return NULL;
 }
 
+void* thread_scale(void* arg) {
+    int num = *(int *)arg;
+    void *ptr[16];
+    for(int i = 0; i < SCALE_OPS / 16; ++i) {
+        for(int j = 0; j < 16; ++j) {
+            ptr[j] = heap_malloc(16 + (num + i + j) % 240); //bez tablicy debug i jej globalnej blokady
+            assert(ptr[j] != NULL);
+            memset(ptr[j], num, 16);
+        }
+        for(int j = 0; j < 16; ++j)
+            heap_free(ptr[j]);
+    }
+    return NULL;
+}
+
+double scale_run(int count) {
+    pthread_t threads[SCALE_THREADS];
+    int param[SCALE_THREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < count; ++i) {
+        param[i] = i;
+        pthread_create(&threads[i], NULL, thread_scale, (void*)(param + i));
+    }
+    for(int i = 0; i < count; ++i)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return 2.0 * SCALE_OPS * count / seconds;
+}
+
 int main(int argc, char **argv)
 {
     //TESTOWANE SA TYLKO FUNKCJE Z RODZINY _DEBUG PONIEWAZ ICH DZIALANIE JEST ZASADNICZO IDENTYCZNE
     printf("1. Test funkcji heap_setup\n");
     assert(heap_setup() == 0); //sterta poprawna
+    //testy ukladu sterty zakladaja wzrost o brakujace strony i natychmiastowe oddawanie pamieci
+    assert(heap_mallopt(HEAP_M_TOP_PAD, 0) == 1);
+    assert(heap_mallopt(HEAP_M_TRIM_THRESHOLD, PAGE_SIZE) == 1);
+    assert(heap_mallopt(HEAP_M_SHARDS, 1) == 1); //jeden shard niezaleznie od liczby procesorow
     printf("OK\n\n");
 
     printf("2. Test funkcji heap_malloc_debug - dzialanie poprawne\n");
@@ -65,6 +142,8 @@ int main(int argc, char **argv)
     char temp[5000];
     memset(temp, 0, 5000);
     assert(memcmp(ptr3, temp, 5000) == 0); //dane musza byc wyzerowane
+    assert(calloc(SIZE_MAX / 2 + 2, 2) == NULL); //iloczyn przepelnia sie do 2 bajtow
+    assert(heap_calloc(SIZE_MAX / 2 + 2, 2) == NULL);
     printf("OK\n\n");
 
     printf("5. Test funkcji heap_realloc_debug - dzialanie poprawne\n");
@@ -106,6 +185,8 @@ int main(int argc, char **argv)
     assert(ptr1 != NULL); //malloc musi sie udac
     assert(((intptr_t)ptr1 & (intptr_t)(PAGE_SIZE - 1)) == 0); //wskaznik musi byc na poczatku strony
     assert(memcmp(ptr1, temp, 5000) == 0); //dane musza byc wyzerowane
+    assert(calloc_aligned(SIZE_MAX / 2 + 2, 2) == NULL); //iloczyn przepelnia sie do 2 bajtow
+    assert(heap_calloc_aligned(SIZE_MAX / 2 + 2, 2) == NULL);
     printf("OK\n\n");
 
     printf("11. Test funkcji heap_realloc_aligned_debug - dzialanie poprawne\n");
@@ -129,9 +210,9 @@ int main(int argc, char **argv)
 
     /*
     * Obecny stan sterty:
-    * Block address: 000000000040F040, size: 3968 - PUSTY
+    * Block address: 000000000040F020, size: 4032 - PUSTY
     * Block address: 0000000000410000, size: 5000 - zaalokowany alligned dla ptr2
-    * Block address: 00000000004113C8, size: 3128 - PUSTY
+    * Block address: 00000000004113A8, size: 3160 - PUSTY
     */
 
     printf("14. Test funkcji heap_get_used_space\n");
@@ -147,11 +228,11 @@ int main(int argc, char **argv)
     printf("OK\n\n");
 
     printf("17. Test funkcji heap_get_free_space\n");
-    assert(heap_get_free_space() == 3968 + 3128);
+    assert(heap_get_free_space() == 4032 + 3160);
     printf("OK\n\n");
 
     printf("18. Test funkcji heap_get_largest_free_area\n");
-    assert(heap_get_largest_free_area() == 3968);
+    assert(heap_get_largest_free_area() == 4032);
     printf("OK\n\n");
 
     printf("19. Test funkcji heap_get_free_gaps_count\n");
@@ -163,7 +244,7 @@ int main(int argc, char **argv)
     assert(get_pointer_type((void *)((intptr_t)ptr2 + 50000)) == pointer_out_of_heap); //pewien dowolny wskaznik wskazujacy poza sterte
     assert(get_pointer_type((void *)((intptr_t)ptr2 - META_SIZE)) == pointer_control_block); //wskaznik na blok kontrolny
     assert(get_pointer_type((void *)((intptr_t)ptr2 + 50)) == pointer_inside_data_block); //wskaznik gdzies wewnatrz bloku z danymi
-    ptr1 = malloc(50);
+    ptr1 = malloc(3500); //miesci sie tylko w pierwszym pustym bloku
     heap_free(ptr1);
     assert(get_pointer_type(ptr1) == pointer_unallocated); //wskaznik na niezaalokowany blok
     assert(get_pointer_type(ptr2) == pointer_valid); //poprawny wskaznik na poczatek danych
@@ -204,6 +285,17 @@ int main(int argc, char **argv)
     for(int i = 0; i < 4; ++i)
         pthread_join(threads[i], NULL);
     assert(heap_get_used_blocks_count() == 1); //liczba blokow musi sie zgadzac
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double single = scale_run(1);
+    printf("threads: 1, ops/s: %.0f\n", single);
+    for(int i = 2; i <= SCALE_THREADS && i <= cpus; i *= 2) {
+        double multi = scale_run(i);
+        printf("threads: %d, ops/s: %.0f (x%.2f)\n", i, multi, multi / single);
+        if(i == 4)
+            assert(multi > single); //pamiec podreczna watku - brak wspolnej blokady na szybkiej sciezce
+    }
+    assert(heap_get_used_blocks_count() == 1); //watki oddaja pamiec podreczna przy zakonczeniu
+    assert(heap_validate() == 0);
     printf("OK\n\n");
 
     //TESTY USZKADZAJACE STERTE:
@@ -244,6 +336,567 @@ int main(int argc, char **argv)
     assert(heap_setup() == 0); //organizujemy sterte of nowa
     assert(heap_get_used_space() == META_SIZE); //nowa sterta musi byc poprawna
     printf("OK\n\n");
+
+    printf("33. Test funkcji heap_get_stats\n");
+    struct heap_stats stats;
+    ptr1 = malloc(5000);
+    ptr2 = malloc(1000);
+    heap_get_stats(&stats);
+    assert(stats.used_space == heap_get_used_space()); //wszystkie pola zgodne z pojedynczymi funkcjami
+    assert(stats.used_space == 3 * META_SIZE + 6000);
+    assert(stats.largest_used_block_size == 5000);
+    assert(stats.used_blocks_count == 2);
+    assert(stats.free_space == heap_get_free_space());
+    assert(stats.largest_free_area == heap_get_largest_free_area());
+    assert(stats.free_gaps_count == 1);
+    heap_free(ptr1);
+    heap_free(ptr2);
+    heap_get_stats(&stats);
+    assert(stats.used_space == META_SIZE && stats.free_space == PAGE_SIZE - META_SIZE);
+    assert(stats.largest_used_block_size == 0 && stats.used_blocks_count == 0);
+    printf("OK\n\n");
+
+    printf("34. Test duzych blokow w obszarze mmap\n");
+    ptr1 = malloc(1024 * 1024);
+    assert(ptr1 != NULL); //malloc musi sie udac
+    assert(heap_get_free_space() == PAGE_SIZE - META_SIZE); //sterta nie rosnie
+    assert(get_pointer_type(ptr1) == pointer_valid);
+    assert(get_pointer_type((void *)((intptr_t)ptr1 + 5000)) == pointer_inside_data_block);
+    assert(heap_get_data_block_start((void *)((intptr_t)ptr1 + 5000)) == ptr1);
+    assert(heap_get_block_size(ptr1) == 1024 * 1024);
+    assert(heap_get_largest_used_block_size() == 1024 * 1024);
+    assert(heap_get_used_space() == 2 * META_SIZE + 1024 * 1024);
+    assert(heap_validate() == 0);
+    heap_free(ptr1);
+    assert(get_pointer_type(ptr1) == pointer_out_of_heap); //strony zwrocone od razu
+    assert(heap_get_used_blocks_count() == 0);
+    printf("OK\n\n");
+
+    printf("35. Test funkcji heap_memalign i heap_posix_memalign\n");
+    void *aligned[8];
+    for(int i = 0; i < 8; ++i) {
+        size_t alignment = (size_t)16 << i; //od 16 do 2048 bajtow
+        aligned[i] = heap_memalign(alignment, 100 + i);
+        assert(aligned[i] != NULL); //malloc musi sie udac
+        assert(((intptr_t)aligned[i] & (intptr_t)(alignment - 1)) == 0); //wskaznik musi byc wyrownany
+        assert(get_pointer_type(aligned[i]) == pointer_valid);
+    }
+    assert(heap_memalign(24, 100) == NULL); //wyrownanie musi byc potega dwojki
+    assert(heap_posix_memalign(&ptr1, 12, 100) == EINVAL);
+    assert(heap_posix_memalign(&ptr1, 64, 100) == 0);
+    assert(((intptr_t)ptr1 & 63) == 0);
+    heap_free(ptr1);
+    for(int i = 0; i < 8; ++i)
+        heap_free(aligned[i]);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_get_free_gaps_count() == 1); //wypelnienie nie zostawia osieroconych dziur
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("36. Test funkcji heap_realloc_debug - zmiana rozmiaru w miejscu\n");
+    ptr1 = malloc(1000);
+    ptr2 = malloc(1000);
+    ptr3 = malloc(1000);
+    memset(ptr1, 1, 1000);
+    heap_free(ptr2);
+    ptr4 = realloc(ptr1, 1800); //wchlania pusty blok po prawej
+    assert(ptr4 == ptr1);
+    assert(heap_get_block_size(ptr4) == 1800);
+    ptr4 = realloc(ptr4, 400); //zmniejszenie oddaje koncowke
+    assert(ptr4 == ptr1);
+    assert(heap_get_block_size(ptr4) == 400);
+    ptr2 = realloc(ptr3, 50000); //ostatni blok rosnie razem ze sterta
+    assert(ptr2 == ptr3);
+    assert(heap_get_block_size(ptr2) == 50000);
+    assert(get_pointer_type((char *)ptr2 + 40000) == pointer_inside_data_block); //strony dolaczone przy wzroscie wskazuja na blok
+    assert(heap_get_data_block_start((char *)ptr2 + 40000) == ptr2);
+    memset(temp, 1, 400);
+    assert(memcmp(ptr4, temp, 400) == 0); //dane musza zostac zachowane
+    heap_free(ptr4);
+    heap_free(ptr2);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("37. Test plyt malych obiektow\n");
+    ptr1 = malloc(24);
+    ptr2 = malloc(24);
+    ptr3 = malloc(200);
+    assert(((intptr_t)ptr2 - (intptr_t)ptr1 == 32) || ((intptr_t)ptr1 - (intptr_t)ptr2 == 32)); //bez naglowka obiektu
+    assert(heap_get_block_size(ptr1) == 32); //rozmiar klasy
+    assert(heap_get_block_size(ptr3) == 208);
+    assert(get_pointer_type(ptr1) == pointer_valid);
+    assert(get_pointer_type((char *)ptr1 + 5) == pointer_inside_data_block);
+    assert(heap_get_data_block_start((char *)ptr1 + 5) == ptr1);
+    assert(heap_get_used_blocks_count() == 2); //jedna plyta na klase
+    memset(ptr1, 7, 24);
+    ptr4 = realloc(ptr1, 30); //miesci sie w klasie
+    assert(ptr4 == ptr1);
+    ptr4 = realloc(ptr1, 100);
+    assert(ptr4 != ptr1);
+    memset(temp, 7, 24);
+    assert(memcmp(ptr4, temp, 24) == 0);
+    heap_free(ptr4);
+    heap_free(ptr2);
+    heap_free(ptr3);
+    heap_free(ptr3); //podwojne zwolnienie nie psuje pamieci podrecznej
+    assert(heap_validate() == 0);
+    assert(heap_get_used_blocks_count() == 0); //puste plyty wracaja do sterty
+    printf("OK\n\n");
+
+    printf("38. Test funkcji heap_arena_*\n");
+    struct heap_arena *arena = heap_arena_create();
+    assert(arena != NULL);
+    ptr1 = heap_arena_alloc(arena, 10);
+    ptr2 = heap_arena_alloc(arena, 10);
+    assert((char *)ptr2 - (char *)ptr1 == 16); //przesuwany wskaznik
+    assert(((intptr_t)ptr1 & 15) == 0);
+    for(int i = 0; i < 1000; ++i)
+        assert(heap_arena_alloc(arena, 100) != NULL);
+    ptr3 = heap_arena_alloc(arena, 100000); //wiekszy od fragmentu
+    assert(ptr3 != NULL);
+    memset(ptr3, 1, 100000);
+    assert(heap_get_used_blocks_count() > 3);
+    heap_arena_reset(arena);
+    assert(heap_get_used_blocks_count() == 2); //arena i biezacy fragment
+    assert(heap_arena_alloc(arena, 10) != NULL);
+    assert(heap_validate() == 0);
+    heap_arena_destroy(arena);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("39. Test funkcji heap_malloc_batch i heap_free_batch\n");
+    void *batch[100];
+    assert(heap_malloc_batch(1000, 100, batch) == 100);
+    for(int i = 1; i < 100; ++i)
+        assert((char *)batch[i] - (char *)batch[i - 1] == 1000 + META_SIZE); //jeden ciagly obszar
+    assert(heap_get_used_blocks_count() == 100);
+    for(int i = 0; i < 100; ++i)
+        memset(batch[i], i, 1000);
+    batch[50] = NULL;
+    heap_free_batch(batch, 100);
+    assert(heap_get_used_blocks_count() == 1);
+    heap_free(heap_get_data_block_start((char *)batch[49] + 1000 + META_SIZE + 1));
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_get_free_gaps_count() == 1);
+    assert(heap_malloc_batch(64, 100, batch) == 100);
+    assert(get_pointer_type(batch[99]) == pointer_valid);
+    assert(heap_get_block_size(batch[0]) == 64);
+    heap_free_batch(batch, 100);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("40. Test funkcji heap_mallopt i heap_trim\n");
+    assert(heap_mallopt(HEAP_M_TOP_PAD, 64 * 1024) == 1);
+    assert(heap_mallopt(HEAP_M_TRIM_THRESHOLD, 128 * 1024) == 1);
+    assert(heap_mallopt(12345, 1) == 0);
+    ptr1 = malloc(10000);
+    size_t heap_size = heap_get_used_space() + heap_get_free_space();
+    assert(heap_size >= 10000 + 64 * 1024); //zapas przy wzroscie
+    for(int i = 0; i < 100; ++i) { //petla na szczycie sterty nie zmienia jej rozmiaru
+        heap_free(ptr1);
+        ptr1 = malloc(10000);
+        assert(heap_get_used_space() + heap_get_free_space() == heap_size);
+    }
+    heap_free(ptr1);
+    assert(heap_get_used_space() + heap_get_free_space() == heap_size); //ponizej progu przyciecia
+    assert(heap_trim(PAGE_SIZE) == 1);
+    assert(heap_get_free_space() >= PAGE_SIZE && heap_get_free_space() < 2 * PAGE_SIZE);
+    assert(heap_trim(0) == 1);
+    assert(heap_get_free_space() == PAGE_SIZE - META_SIZE);
+    assert(heap_trim(0) == 0);
+    ptr1 = malloc(100000);
+    heap_free(ptr1); //powyzej progu - zostaje tylko zapas
+    assert(heap_get_free_space() >= 64 * 1024 && heap_get_free_space() < 64 * 1024 + PAGE_SIZE);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("41. Test funkcji heap_setup_reserve\n");
+    assert(heap_setup_reserve((size_t)1024 * 1024 * 1024) == 0); //wieksza rezerwacja
+    ptr1 = heap_malloc(1024 * 1024 * 200); //nie miesci sie w domyslnych 64MB
+    assert(ptr1 != NULL);
+    memset(ptr1, 1, 1024 * 1024 * 200);
+    ptr2 = malloc(100000);
+    assert(ptr2 != NULL);
+    heap_free(ptr1);
+    heap_free(ptr2);
+    assert(heap_validate() == 0);
+    assert(heap_setup_reserve(64 * 1024) == 0); //mala rezerwacja
+    assert(heap_malloc(100 * 1024) == NULL);
+    ptr1 = malloc(40 * 1024);
+    assert(ptr1 != NULL);
+    heap_free(ptr1);
+    assert(heap_validate() == 0);
+    assert(heap_setup_reserve(PAGE_SIZE * 16384) == 0); //powrot do domyslnej sterty
+    assert(heap_get_used_space() == META_SIZE);
+    assert(heap_setup_reserve((size_t)1 << 50) == -1); //brak przestrzeni adresowej - zostaje stara rezerwacja
+    assert(heap_get_heap_size() == PAGE_SIZE && heap_get_used_space() == META_SIZE);
+    ptr1 = malloc(40 * 1024 * 1024);
+    assert(ptr1 != NULL);
+    heap_free(ptr1);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("42. Test funkcji heap_trace_start i heap_trace_stop\n");
+    char trace_path[] = "/tmp/heap_traceXXXXXX";
+    int trace_fd = mkstemp(trace_path);
+    assert(trace_fd >= 0);
+    assert(heap_trace_start(trace_path) == 0);
+    assert(heap_trace_start(trace_path) == -1); //slad juz trwa
+    ptr1 = calloc(10, 100); //calloc_debug wywoluje malloc_debug - jeden rekord
+    ptr2 = realloc(ptr1, 5000);
+    ptr3 = heap_memalign(64, 300);
+    heap_free(ptr2);
+    heap_free(ptr3);
+    heap_trace_stop();
+    struct heap_trace_header trace_header;
+    struct heap_trace_record trace[8];
+    assert(read(trace_fd, &trace_header, sizeof(trace_header)) == sizeof(trace_header));
+    assert(memcmp(trace_header.magic, HEAP_TRACE_MAGIC, 8) == 0 && trace_header.record_size == sizeof(struct heap_trace_record));
+    assert(read(trace_fd, trace, sizeof(trace)) == 5 * sizeof(struct heap_trace_record));
+    assert(trace[0].op == trace_calloc && trace[0].size == 1000 && trace[0].result == (uintptr_t)ptr1);
+    assert(trace[1].op == trace_realloc && trace[1].pointer == (uintptr_t)ptr1 && trace[1].result == (uintptr_t)ptr2);
+    assert(trace[2].op == trace_malloc && trace[2].alignment_log2 == 6 && trace[2].result == (uintptr_t)ptr3);
+    assert(trace[3].op == trace_free && trace[3].pointer == (uintptr_t)ptr2);
+    assert(trace[4].op == trace_free && trace[4].pointer == (uintptr_t)ptr3);
+    assert(trace[0].thread == trace[4].thread && trace[0].timestamp <= trace[4].timestamp);
+    close(trace_fd);
+    unlink(trace_path);
+    heap_free(heap_malloc(100)); //po zatrzymaniu nic nie jest zapisywane
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("43. Test zwolnien odkladanych do kolejki, gdy mut jest zajety\n");
+    void *remote[TCACHE_TEST_OBJECTS + 1];
+    uint64_t blocks = heap_get_used_blocks_count();
+    for(int i = 0; i < TCACHE_TEST_OBJECTS; ++i)
+        remote[i] = heap_malloc(64);
+    remote[TCACHE_TEST_OBJECTS] = heap_malloc(1000);
+    pthread_mutex_lock(&mut); //watek zwalniajacy nie moze czekac na mut
+    pthread_t remote_thread;
+    pthread_create(&remote_thread, NULL, thread_free_all, remote);
+    pthread_join(remote_thread, NULL);
+    heap_free(remote[TCACHE_TEST_OBJECTS]); //podwojne zwolnienie bloku w kolejce
+    heap_free(remote[0]); //podwojne zwolnienie obiektu w kolejce
+    pthread_mutex_unlock(&mut);
+    assert(heap_get_used_blocks_count() == blocks); //kolejka oproznona przy pobraniu mut
+    assert(get_pointer_type(remote[TCACHE_TEST_OBJECTS]) == pointer_unallocated);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("44. Test shardow sterty\n");
+    assert(heap_mallopt(HEAP_M_SHARDS, 0) == 0);
+    assert(heap_mallopt(HEAP_M_SHARDS, 4) == 1);
+    blocks = heap_get_used_blocks_count();
+    size_t shard_heap = heap_get_heap_size();
+    void *sharded[4];
+    int shard_param = 0;
+    for(int i = 0; i < 4; ++i) { //kolejne watki dostaja kolejne shardy
+        pthread_t shard_thread;
+        pthread_create(&shard_thread, NULL, thread_test, &shard_param);
+        pthread_join(shard_thread, &sharded[i]);
+        assert(get_pointer_type(sharded[i]) == pointer_valid);
+        assert(heap_get_block_size(sharded[i]) == 500);
+    }
+    for(int i = 0; i < 4; ++i)
+        for(int j = i + 1; j < 4; ++j) //kazdy shard ma osobny obszar wielkosci sterty
+            assert(labs((intptr_t)sharded[i] - (intptr_t)sharded[j]) > PAGE_SIZE * 16384 / 2);
+    assert(heap_get_heap_size() >= shard_heap + 3 * PAGE_SIZE);
+    assert(heap_get_used_blocks_count() == blocks + 4);
+    assert(heap_validate() == 0);
+    for(int i = 0; i < 4; ++i) //zwolnienie trafia do shardu wlasciciela
+        heap_free(sharded[i]);
+    assert(heap_get_used_blocks_count() == blocks);
+    for(int i = 0; i < 4; ++i)
+        assert(get_pointer_type(sharded[i]) == pointer_unallocated);
+    assert(heap_validate() == 0);
+    assert(heap_mallopt(HEAP_M_SHARDS, 1) == 1);
+    printf("OK\n\n");
+
+    printf("45. Test stron ogromnych (THP)\n");
+    assert(heap_mallopt(HEAP_M_HUGE_PAGES, 1) == 1);
+    assert(heap_setup() == 0);
+    ptr1 = malloc(10000);
+    assert(ptr1 != NULL);
+    assert(((intptr_t)ptr1 - META_SIZE) % HUGE_PAGE_SIZE == 0); //poczatek sterty na granicy strony ogromnej
+    assert(heap_get_heap_size() == HUGE_PAGE_SIZE); //wzrost o cala strone ogromna
+    void *huge[30];
+    for(int i = 0; i < 30; ++i) {
+        huge[i] = malloc(100000);
+        assert(huge[i] != NULL);
+        assert(heap_get_heap_size() % HUGE_PAGE_SIZE == 0);
+    }
+    assert(heap_get_heap_size() == 2 * HUGE_PAGE_SIZE);
+    for(int i = 29; i >= 0; --i) { //przyciecie tylko do granicy strony ogromnej
+        heap_free(huge[i]);
+        assert(heap_get_heap_size() % HUGE_PAGE_SIZE == 0);
+    }
+    assert(heap_get_heap_size() == HUGE_PAGE_SIZE);
+    heap_free(ptr1);
+    assert(heap_trim(0) == 0); //pierwsza strona ogromna zostaje
+    assert(heap_get_heap_size() == HUGE_PAGE_SIZE);
+    assert(heap_validate() == 0);
+    assert(heap_mallopt(HEAP_M_HUGE_PAGES, 0) == 1);
+    assert(heap_trim(0) == 1);
+    assert(heap_get_heap_size() == PAGE_SIZE);
+    printf("OK\n\n");
+
+    printf("46. Test profilu sterty (heap_profile_dump)\n");
+    assert(heap_mallopt(HEAP_M_PROFILE_RATE, 1) == 1); //srednio co bajt - probka przy kazdej alokacji
+    void *profiled[20];
+    pthread_t profile_thread; //nowy watek zaczyna odliczanie od razu
+    pthread_create(&profile_thread, NULL, thread_profile, profiled);
+    pthread_join(profile_thread, NULL);
+    char profile_path[] = "/tmp/heap_profile_XXXXXX";
+    int profile_fd = mkstemp(profile_path);
+    assert(profile_fd >= 0);
+    close(profile_fd);
+    assert(heap_profile_dump(profile_path) == 0);
+    FILE *profile = fopen(profile_path, "r");
+    char profile_line[1024];
+    assert(fgets(profile_line, sizeof(profile_line), profile) != NULL);
+    assert(strcmp(profile_line, "heap profile: 15: 5640 [20: 10640] @ heap_v2/1\n") == 0); //zywe: 5 x 1000 i 10 x 64
+    int profile_samples = 0;
+    bool mapped_libraries = false;
+    while(fgets(profile_line, sizeof(profile_line), profile)) {
+        if(strncmp(profile_line, "1: ", 3) == 0 && strstr(profile_line, "@ 0x"))
+            ++profile_samples;
+        if(strcmp(profile_line, "MAPPED_LIBRARIES:\n") == 0)
+            mapped_libraries = true;
+    }
+    fclose(profile);
+    assert(profile_samples == 15 && mapped_libraries);
+    for(int i = 0; i < 20; ++i) //zwolnienie z innego watku usuwa probke
+        if(i % 4)
+            heap_free(profiled[i]);
+    assert(heap_profile_dump(profile_path) == 0);
+    profile = fopen(profile_path, "r");
+    assert(fgets(profile_line, sizeof(profile_line), profile) != NULL);
+    assert(strcmp(profile_line, "heap profile: 0: 0 [20: 10640] @ heap_v2/1\n") == 0);
+    fclose(profile);
+    int sampling_stop = 0;
+    pthread_create(&profile_thread, NULL, thread_sampling, &sampling_stop);
+    for(int i = 0; i < 50; ++i) { //fork w trakcie probkowania w innym watku
+        pid_t child = fork();
+        assert(child >= 0);
+        if(child == 0) {
+            alarm(5); //zakleszczenie konczy proces sygnalem
+            heap_free(heap_malloc(1000));
+            _exit(0);
+        }
+        int child_status;
+        assert(waitpid(child, &child_status, 0) == child);
+        assert(WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0); //potomek nie dziedziczy zajetego sample_mut
+    }
+    __atomic_store_n(&sampling_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(profile_thread, NULL);
+    pthread_create(&profile_thread, NULL, thread_profile_aligned, profiled);
+    pthread_join(profile_thread, NULL);
+    assert(heap_profile_dump(profile_path) == 0);
+    profile = fopen(profile_path, "r");
+    assert(fgets(profile_line, sizeof(profile_line), profile) != NULL);
+    assert(strncmp(profile_line, "heap profile: 1: 100 [", 22) == 0);
+    fclose(profile);
+    unlink(profile_path);
+    for(int i = 0; i < 3; ++i)
+        heap_free(profiled[i]);
+    assert(heap_mallopt(HEAP_M_PROFILE_RATE, 0) == 1);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("47. Test raportu miejsc alokacji (heap_dump_call_sites)\n");
+    assert(heap_setup() == 0);
+    void *site_ptrs[4];
+    int site_line = __LINE__ + 2;
+    for(int i = 0; i < 3; ++i)
+        site_ptrs[i] = malloc(100);
+    site_ptrs[3] = malloc(5000);
+    heap_free(site_ptrs[0]);
+    assert(heap_realloc(site_ptrs[3], 4000) == site_ptrs[3]); //w miejscu, bez miejsca wywolania - zmienia sie tylko rozmiar
+    char sites_path[] = "/tmp/heap_sites_XXXXXX", site_name[64], site_expected[2][64];
+    snprintf(site_expected[0], sizeof(site_expected[0]), "%.30s:%d", __FILE__, site_line + 1);
+    snprintf(site_expected[1], sizeof(site_expected[1]), "%.30s:%d", __FILE__, site_line);
+    size_t site_count, site_bytes, site_peak;
+    for(int pass = 0; pass < 2; ++pass) {
+        int sites_fd = mkstemp(sites_path);
+        assert(sites_fd >= 0);
+        int saved_stdout = dup(1);
+        dup2(sites_fd, 1); //raport na stdout
+        heap_dump_call_sites();
+        dup2(saved_stdout, 1);
+        close(saved_stdout);
+        close(sites_fd);
+        FILE *sites = fopen(sites_path, "r");
+        assert(fgets(profile_line, sizeof(profile_line), sites) != NULL); //naglowek
+        for(int i = 0; i < 2; ++i) { //kolejnosc wg zywych bajtow
+            assert(fscanf(sites, "%63s %zu %zu %zu", site_name, &site_count, &site_bytes, &site_peak) == 4);
+            assert(strcmp(site_name, site_expected[i]) == 0);
+            if(pass == 0)
+                assert(i == 0 ? site_count == 1 && site_bytes == 4000 && site_peak == 5000 : site_count == 2 && site_bytes == 200 && site_peak == 300);
+            else
+                assert(site_count == 0 && site_bytes == 0 && site_peak == (i == 0 ? 5000 : 300)); //szczyt zostaje
+        }
+        fclose(sites);
+        unlink(sites_path);
+        strcpy(sites_path, "/tmp/heap_sites_XXXXXX");
+        for(int i = 1; pass == 0 && i < 4; ++i)
+            heap_free(site_ptrs[i]);
+    }
+    char stack_name[16] = "stos.c"; //nazwa w buforze na stosie, zmieniana po alokacji
+    site_ptrs[0] = heap_malloc_debug(6000, 1, stack_name);
+    strcpy(stack_name, "inny.c");
+    site_ptrs[1] = heap_malloc_debug(5500, 2, stack_name);
+    memset(stack_name, 0, sizeof(stack_name));
+    int sites_fd = mkstemp(sites_path);
+    assert(sites_fd >= 0);
+    int saved_stdout = dup(1);
+    dup2(sites_fd, 1);
+    heap_dump_call_sites();
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+    close(sites_fd);
+    FILE *sites = fopen(sites_path, "r");
+    assert(fgets(profile_line, sizeof(profile_line), sites) != NULL);
+    assert(fscanf(sites, "%63s %zu %zu %zu", site_name, &site_count, &site_bytes, &site_peak) == 4);
+    assert(strcmp(site_name, "stos.c:1") == 0 && site_bytes == 6000); //alokator trzyma kopie nazw
+    assert(fscanf(sites, "%63s %zu %zu %zu", site_name, &site_count, &site_bytes, &site_peak) == 4);
+    assert(strcmp(site_name, "inny.c:2") == 0 && site_bytes == 5500);
+    fclose(sites);
+    unlink(sites_path);
+    heap_free(site_ptrs[0]);
+    heap_free(site_ptrs[1]);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("48. Test walidacji przyrostowej (heap_validate_step)\n");
+    assert(heap_setup() == 0);
+    void *stepped[20];
+    for(int i = 0; i < 20; ++i)
+        stepped[i] = malloc(1000);
+    int step_calls = 0, step_result;
+    while((step_result = heap_validate_step(4)) == 0) //najwyzej 4 bloki w kroku
+        ++step_calls;
+    assert(step_result == 1 && step_calls >= 5);
+    meta = (struct block_meta *)((intptr_t)stepped[15] - META_SIZE);
+    uint8_t step_fence = meta->end_fence;
+    meta->end_fence = 0;
+    while((step_result = heap_validate_step(4)) == 0);
+    assert(step_result == -3); //uszkodzony plotek struktury
+    meta->end_fence = step_fence;
+    assert(heap_validate_step(8) == 0);
+    for(int i = 0; i < 10; ++i) //bloki pod kursorem sa scalane miedzy krokami
+        heap_free(stepped[i]);
+    while((step_result = heap_validate_step(4)) == 0);
+    assert(step_result == 1);
+    assert(heap_validate_start(0) == -1);
+    assert(heap_validate_start(50) == 0); //walidacja w tle w trakcie alokacji w shardach
+    assert(heap_validate_start(50) == -1);
+    assert(heap_mallopt(HEAP_M_SHARDS, 4) == 1);
+    scale_run(4);
+    assert(heap_validate_stop() == 0);
+    assert(heap_mallopt(HEAP_M_SHARDS, 1) == 1);
+    meta->end_fence = 0;
+    assert(heap_validate_start(100) == 0);
+    struct timespec step_pause = {0, 1000000};
+    int restarted = -1;
+    for(int i = 0; i < 5000 && (restarted = heap_validate_start(100)) == -1; ++i)
+        nanosleep(&step_pause, NULL);
+    assert(restarted == 0); //watek konczy prace sam po znalezieniu bledu, mozna uruchomic nowy
+    meta->end_fence = step_fence;
+    step_result = heap_validate_stop();
+    assert(step_result == 0 || step_result == -3); //nowy watek mogl trafic na plotek przed naprawa
+    assert(heap_validate_stop() == step_result);
+    for(int i = 10; i < 20; ++i)
+        heap_free(stepped[i]);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("49. Test sum kontrolnych naglowkow\n");
+    assert(heap_setup() == 0);
+    ptr1 = malloc(1000);
+    ptr2 = malloc(1000);
+    meta = (struct block_meta *)((intptr_t)ptr2 - META_SIZE);
+    meta->mapped = true; //plotki i wskazniki poprawne, naglowek nie
+    assert(heap_validate() == -3);
+    heap_free(ptr2); //uszkodzony blok nie jest zwalniany
+    assert(heap_get_used_blocks_count() == 2);
+    meta->mapped = false;
+    assert(heap_validate() == 0);
+    meta->debug = false; //pola zmieniane poza blokada shardu nie sa objete suma
+    assert(heap_validate() == 0);
+    meta->debug = true;
+    size_t checked_size = meta->size;
+    meta->size ^= 1;
+    assert(heap_validate() != 0);
+    meta->size = checked_size;
+    heap_free(ptr2);
+    heap_free(ptr1);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("50. Test funkcji heap_calloc - pamiec juz wyzerowana nie jest czyszczona\n");
+    assert(heap_setup() == 0);
+    size_t zero_size = 16 * 1024 * 1024;
+    unsigned char resident[4096 + 1];
+    char *zeroed = calloc(zero_size, 1); //obszar mmap
+    assert(zeroed != NULL);
+    assert(mincore((void *)((intptr_t)zeroed & ~(intptr_t)(PAGE_SIZE - 1)), zero_size, resident) == 0);
+    int resident_pages = 0;
+    for(size_t i = 0; i < zero_size / PAGE_SIZE; ++i)
+        resident_pages += resident[i] & 1;
+    assert(resident_pages <= 1); //tylko strona naglowka
+    for(size_t i = 0; i < zero_size; i += PAGE_SIZE / 2)
+        assert(zeroed[i] == 0);
+    memset(zeroed, 0xAA, zero_size);
+    heap_free(zeroed);
+    zeroed = calloc(zero_size, 1); //strony zwolnionego bloku wrocily do systemu
+    for(size_t i = 0; i < zero_size; ++i)
+        assert(zeroed[i] == 0);
+    heap_free(zeroed);
+    ptr1 = malloc(5000);
+    memset(ptr1, 0xAA, 5000);
+    heap_free(ptr1);
+    ptr1 = calloc(5000, 1); //ponownie uzyty blok jest czyszczony
+    for(int i = 0; i < 5000; ++i)
+        assert(((char *)ptr1)[i] == 0);
+    zeroed = calloc(100000, 1); //nowe strony na szczycie sterty
+    assert(mincore((void *)((intptr_t)zeroed & ~(intptr_t)(PAGE_SIZE - 1)), 100000, resident) == 0);
+    resident_pages = 0;
+    for(size_t i = 0; i < 100000 / PAGE_SIZE; ++i)
+        resident_pages += resident[i] & 1;
+    assert(resident_pages <= 2);
+    for(int i = 0; i < 100000; ++i)
+        assert(zeroed[i] == 0);
+    ptr2 = calloc_aligned(3, 1000);
+    for(int i = 0; i < 3000; ++i)
+        assert(((char *)ptr2)[i] == 0);
+    heap_free(ptr2);
+    heap_free(zeroed);
+    heap_free(ptr1);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
+
+    printf("51. Test funkcji heap_realloc_aligned_debug - blok niewyrownany\n");
+    assert(heap_setup() == 0);
+    ptr1 = malloc(1000);
+    assert(((intptr_t)ptr1 & (intptr_t)(PAGE_SIZE - 1)) != 0);
+    memset(ptr1, 0x5A, 1000);
+    ptr2 = realloc_aligned(ptr1, 2000); //miejsce za blokiem jest wolne, ale blok musi sie przeniesc
+    assert(ptr2 != NULL && ptr2 != ptr1);
+    assert(((intptr_t)ptr2 & (intptr_t)(PAGE_SIZE - 1)) == 0);
+    for(int i = 0; i < 1000; ++i)
+        assert(((unsigned char *)ptr2)[i] == 0x5A);
+    assert(get_pointer_type(ptr1) != pointer_valid);
+    ptr3 = realloc_aligned(ptr2, 3000); //wyrownany blok moze rosnac w miejscu
+    assert(((intptr_t)ptr3 & (intptr_t)(PAGE_SIZE - 1)) == 0);
+    heap_free(ptr3);
+    assert(heap_get_used_blocks_count() == 0);
+    assert(heap_validate() == 0);
+    printf("OK\n\n");
 }
 
 #if 0 //PASSED
@@ -6,14 +6,19 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
-#include <math.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "custom_unistd.h"
 
 #define PAGE_SIZE       4096    // Długość strony w bajtach
 #define PAGE_FENCE      1       // Liczba stron na jeden płotek
-#define PAGES_AVAILABLE 16384   // Liczba stron dostępnych dla sterty
-#define PAGES_TOTAL     (PAGES_AVAILABLE + 2 * PAGE_FENCE)
+#define PAGES_AVAILABLE 16384   // Domyślna liczba stron dostępnych dla sterty
+#define RESERVE_ENV     "HEAP_RESERVE" // Zmienna środowiskowa z rozmiarem rezerwacji, np. 64M, 8G
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024) // Rozmiar przezroczystej strony ogromnej (THP)
+#define HUGE_PAGES_ENV  "HEAP_HUGEPAGES" // Zmienna środowiskowa włączająca strony ogromne, np. 1
 
 #define malloc(_size) heap_malloc_debug((_size), __LINE__, __FILE__)
 #define calloc(_number, _size) heap_calloc_debug((_number), (_size), __LINE__, __FILE__)
@@ -25,11 +30,299 @@
 #define DATA_PTR(META_PTR) (((intptr_t) META_PTR) + META_SIZE)
 #define START_VAL 85    //01010101
 #define END_VAL 170     //10101010
+#define FREE_LINKS(META_PTR) ((struct free_links *)DATA_PTR(META_PTR))
+#define MIN_FREE_SIZE (sizeof(struct free_links))
+#define TLSF_SL_LOG2    4       // Liczba bitów drugiego poziomu indeksu TLSF
+#define TLSF_SL_COUNT   (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT   48      // Liczba klas potęg dwójki
+#define PAGE_INDEX(PTR) (((intptr_t)(PTR) - mm.start_brk) / PAGE_SIZE)
+#define DEBUG_TABLE_MIN 1024    // Początkowa pojemność tablic informacji debugowych
+#define DEBUG_NAMES_AREA (16 * PAGE_SIZE) // Obszar na kopie nazw plików, kolejne w miarę potrzeby
+#define DEBUG_SITE_REPORT 10    // Liczba miejsc alokacji w podsumowaniu wycieków
+#define SLAB_STEP       16      // Szerokość klasy rozmiarów obiektów płyty
+#define SLAB_CLASSES    16      // Liczba klas rozmiarów (obiekty do 256 bajtów)
+#define SLAB_MAX_SIZE   (SLAB_STEP * SLAB_CLASSES)
+#define SLAB_SIZE       (PAGE_SIZE - META_SIZE) // Płyta wypełnia stronę, nagłówek następnego bloku kończy ją
+#define SLAB_HEADER     ((sizeof(struct slab) + SLAB_STEP - 1) / SLAB_STEP * SLAB_STEP)
+#define SLAB_DATA(SLAB_PTR) ((intptr_t)(SLAB_PTR) + (intptr_t)SLAB_HEADER)
+#define SLAB_OBJECTS    (SLAB_SIZE / SLAB_STEP) // Górne ograniczenie liczby obiektów w płycie
+#define TCACHE_REFILL   8       // Liczba obiektów pobieranych z płyt naraz
+#define TCACHE_LIMIT    32      // Maksymalna liczba obiektów w jednej klasie
+#define REMOTE_BATCH    64      // Liczba zwolnień z kolejki oddawanych naraz
+#define SHARDS_MAX      8       // Maksymalna liczba shardów sterty
+#define ARENA_CHUNK_SIZE (4 * PAGE_SIZE - META_SIZE) // Domyślny rozmiar fragmentu areny
+#define ARENA_ALIGN     16      // Wyrównanie obiektów areny
+#define ARENA_HEADER    ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+#define DEFAULT_TOP_PAD (128 * 1024) // Domyślny zapas przy powiększaniu sterty
+#define DEFAULT_TRIM_THRESHOLD (256 * 1024) // Domyślny próg oddawania wolnego końca sterty
+#define MMAP_THRESHOLD  (128 * 1024) // Bloki od tej wielkości trafiają do obszaru mmap
+#define TRACE_ENV       "HEAP_TRACE" // Zmienna środowiskowa z plikiem śladu alokacji
+#define TRACE_BUFFER    4096    // Liczba rekordów śladu zapisywanych do pliku naraz
+#define PROFILE_ENV     "HEAP_PROFILE_RATE" // Zmienna środowiskowa ze średnim odstępem próbek profilu w bajtach
+#define SAMPLE_DEPTH    32      // Maksymalna głębokość stosu próbki
+#define SAMPLE_TABLE_MIN 256    // Początkowa pojemność tablicy próbek
+#define SAMPLE_IDLE     (1024 * 1024) // Co tyle bajtów wątek sprawdza, czy profil został włączony
+#define VALIDATE_STEP   256     // Liczba bloków sprawdzanych w jednym kroku wątku walidacji
+#define CRC32C_POLY     0x82F63B78 // Wielomian CRC32C (Castagnoli) w odwróconej postaci
+#define RESERVED_PAGES(PAGES) ((PAGES) * SHARDS_MAX) // Obszar sbrk/mmap i obszary shardów 1..N-1 tej samej wielkości
+#define MAPPED_SIZE(META_PTR) (((META_SIZE + (META_PTR)->size) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE)
 
-uint8_t memory[PAGE_SIZE * PAGES_TOTAL] __attribute__((aligned(PAGE_SIZE)));
+uint8_t *memory = NULL; // Rezerwacja mmap: płotek, strony sterty, płotek
 
-struct block_meta *heap = NULL;
-pthread_mutex_t mut;
+pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER; // Blokada shardu 0
+
+// Pusty blok przechowuje w obszarze danych dowiązania listy swojego koszyka
+struct free_links {
+    struct block_meta *prev_free;
+    struct block_meta *next_free;
+};
+
+struct tlsf_index {
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    struct block_meta *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+};
+
+// Płyta: strona obiektów jednej klasy rozmiaru, bez nagłówków obiektów;
+// sama płyta jest obszarem danych zwykłego bloku sterty
+struct slab {
+    struct slab *prev;      //płyty klasy z wolnymi miejscami
+    struct slab *next;
+    uint64_t used_map[(SLAB_OBJECTS + 63) / 64]; //zajęte obiekty, bity poza pojemnością ustawione
+    uint32_t debug;         //obiekty z informacją debugową
+    uint32_t sampled;       //obiekty w profilu sterty
+    uint16_t size;
+    uint16_t used;          //razem z obiektami w pamięciach podręcznych wątków
+    uint16_t capacity;
+    uint8_t cls;
+};
+
+static bool *slab_pages; //strony zaczynające się płytą
+
+// Obiekt w pamięci podręcznej wątku
+struct tcache_entry {
+    struct tcache_entry *next;
+    struct tcache *key;     //wykrywa podwójne zwolnienie
+};
+
+// Pamięć podręczna wątku: obiekty płyt zwolnione przez wątek
+struct tcache {
+    struct tcache_entry *bins[SLAB_CLASSES];
+    unsigned count[SLAB_CLASSES];
+    unsigned total;
+    unsigned epoch;
+    bool registered;
+};
+
+// Zwolnienie odłożone, gdy mut był zajęty; wpis w obszarze danych bloku lub obiektu
+struct remote_entry {
+    struct remote_entry *next;
+    const void *key;        //&remote_key - wpis czeka w kolejce, wykrywa podwójne zwolnienie
+};
+
+static const int remote_key; //adres oznaczający wpis w kolejce
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static unsigned heap_epoch; //zmieniana przy resecie sterty, unieważnia pamięci podręczne
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+// Bloki mniejsze od strony wg rozmiaru, z mapą bitową niezerowych liczników
+struct size_counts {
+    uint32_t count[PAGE_SIZE];
+    uint64_t map[PAGE_SIZE / 64];
+    uint64_t summary;
+};
+
+// Liczniki statystyk sterty, aktualizowane przy każdej zmianie bloku
+struct heap_counters {
+    size_t used_bytes;
+    uint64_t used_blocks;
+    uint64_t blocks;
+    size_t free_bytes;
+    uint64_t free_gaps;
+    struct size_counts small_used;  //zajęte bloki mniejsze od strony
+    struct size_counts small_free;  //puste bloki mniejsze od strony, także spoza indeksu TLSF
+    size_t large_count;
+    size_t large_free_count;
+};
+
+// Kopce zajętych i pustych bloków co najmniej stronicowych (w shardzie) i pozycje w kopcach
+// wg strony nagłówka; taki blok jest jedynym nagłówkiem tej wielkości na swojej stronie
+static struct block_meta **large_tables;
+static struct block_meta **large_free_tables;
+static uint32_t *large_pos;
+static uint32_t *large_free_pos;
+
+// Shard: niezależna sterta z własną listą bloków, blokadą i kursorem wzrostu. Shard 0 rośnie
+// przez custom_sbrk i obsługuje obszar mmap, shardy 1..N-1 mają obszary za obszarem mmap
+struct heap_shard {
+    pthread_mutex_t *mut;
+    struct block_meta *heap;    //NULL - shard jeszcze nieużywany
+    struct block_meta *tail;    //ostatni blok, kończy się na kursorze wzrostu
+    struct tlsf_index tlsf;
+    struct heap_counters counters;
+    struct block_meta **large_used;
+    struct block_meta **large_free;
+    struct slab *slabs[SLAB_CLASSES];
+    struct remote_entry *remote_frees; //kolejka MPSC: dokłada każdy wątek bez blokady, opróżnia posiadacz mut
+    intptr_t start;             //obszar shardu 1..N-1 i jego kursor wzrostu
+    intptr_t brk;
+    intptr_t end;
+    intptr_t clean;             //od tego adresu do kursora wzrostu pamięć jest wyzerowana
+};
+
+static struct heap_shard shards[SHARDS_MAX];
+static pthread_mutex_t shard_mut[SHARDS_MAX - 1] = { [0 ... SHARDS_MAX - 2] = PTHREAD_MUTEX_INITIALIZER };
+static unsigned shard_count = 0;    //liczba używanych shardów, 0 - wg liczby procesorów
+static unsigned shard_next;         //przydział wątków po kolei
+static __thread struct heap_shard *shard;   //shard, którego mut trzyma wątek
+static __thread struct heap_shard *home;    //shard wątku, zmieniany gdy jest zajęty
+static __thread size_t alloc_dirty;         //bajty na początku ostatniego bloku, w których mogą być stare dane
+
+// Miejsce alokacji bloków debugowych, poza nagłówkiem bloku
+struct debug_entry {
+    const void *key;        //adres danych bloku lub obiektu płyty
+    const char *filename;   //kopia nazwy z debug_intern, wspólna dla wszystkich bloków
+    int fileline;
+    size_t size;            //rozmiar podany przy alokacji
+};
+
+// Miejsce alokacji: zajęte bloki debugowe z jednego filename:fileline, liczone przy każdej zmianie
+struct debug_site {
+    const char *filename;   //nazwa z debug_intern, NULL - wolne miejsce tablicy
+    int fileline;
+    size_t count;
+    size_t bytes;
+    size_t peak;            //najwięcej bajtów naraz
+};
+
+struct debug_sites {
+    struct debug_site *entries;
+    size_t capacity;
+    size_t count;
+};
+
+struct debug_table {
+    struct debug_entry *entries;
+    size_t capacity;
+    size_t count;
+};
+
+// Nazwy plików skopiowane do pamięci alokatora, indeksowane skrótem treści
+struct debug_name {
+    const char *name;       //kopia, NULL - wolne miejsce tablicy
+    size_t hash;
+};
+
+struct debug_names {
+    struct debug_name *entries;
+    size_t capacity;
+    size_t count;
+    char *area;             //miejsce na następne kopie
+    size_t area_left;
+};
+
+static struct debug_table debug_blocks;
+static struct debug_names debug_names;
+static struct debug_sites debug_sites;
+static pthread_mutex_t debug_mut = PTHREAD_MUTEX_INITIALIZER;
+
+// Mapa stron: nagłówek bloku, w którym leży początek danej strony (lub NULL);
+// w obszarze mmap każda strona bloku wskazuje jego nagłówek
+static struct block_meta **page_map;
+
+// Tablice stronowe (page_map, large_used, large_free, pozycje w kopcach, slab_pages) w jednym odwzorowaniu,
+// strony dostają pamięć dopiero przy pierwszym zapisie
+static void *page_tables = NULL;
+static size_t page_tables_size;
+
+// Fragment areny: zwykły blok sterty, obiekty przydzielane za nagłówkiem fragmentu
+struct arena_chunk {
+    struct arena_chunk *next;   //wcześniej pobrane fragmenty
+    size_t size;
+};
+
+// Arena: wskaźnik przesuwany w bieżącym fragmencie, zwalniana tylko w całości
+struct heap_arena {
+    struct arena_chunk *chunks; //bieżący fragment na początku listy
+    intptr_t top;
+    intptr_t end;
+};
+
+// Parametry wzrostu i przycinania sterty, zmieniane przez heap_mallopt
+static size_t top_pad = DEFAULT_TOP_PAD;               //0 - wzrost dokładnie o brakujące strony
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+static bool huge_pages = false;     //wzrost i przycinanie co HUGE_PAGE_SIZE, pamięć z madvise(MADV_HUGEPAGE)
+
+// Ślad alokacji: rekordy buforowane pod trace_mut i dopisywane do pliku przez write
+static int trace_fd = -1;
+static bool trace_on = false;
+static uint64_t trace_start;
+static struct heap_trace_record trace_buffer[TRACE_BUFFER];
+static size_t trace_count;
+static pthread_mutex_t trace_mut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread uint32_t trace_thread;
+static __thread bool trace_nested;  //wywołanie wewnątrz śledzonej funkcji nie tworzy własnego rekordu
+
+// Próbka profilu: żywy obiekt wybrany średnio raz na sample_rate bajtów i stos jego alokacji
+struct sample_entry {
+    const void *key;        //adres danych bloku lub obiektu płyty
+    size_t size;
+    uint32_t depth;
+    void *stack[SAMPLE_DEPTH];
+};
+
+struct sample_table {
+    struct sample_entry *entries;
+    size_t capacity;
+    size_t count;
+};
+
+// Profil sterty: próbki pod sample_mut, odliczanie do następnej próbki w każdym wątku
+static struct sample_table samples;
+static pthread_mutex_t sample_mut = PTHREAD_MUTEX_INITIALIZER; //po debug_mut, pod nim nic nie jest blokowane
+static pthread_once_t sample_once = PTHREAD_ONCE_INIT;
+static size_t sample_rate = 0;      //0 - profil wyłączony
+static uint64_t sample_total;       //wszystkie próbki od włączenia profilu
+static uint64_t sample_total_bytes;
+static __thread int64_t sample_bytes;   //bajty do następnej próbki, poniżej zera - próbka
+static __thread bool sample_started;    //pierwszy odstęp wątku już wylosowany
+static __thread bool sample_busy;       //backtrace i zapis profilu mogą alokować
+static __thread uint64_t sample_seed;
+
+// Walidacja przyrostowa: kursor przechodzi kolejno plotki sterty, bloki mmap i shardy
+enum validate_phase { validate_fences, validate_mapped, validate_shards };
+
+struct validate_cursor {
+    unsigned epoch;     //heap_epoch przy ustawieniu kursora, reset sterty cofa kursor na początek
+    int phase;          //validate_shards + i - shard i
+    intptr_t next;      //adres następnego bloku, 0 - od początku listy
+};
+
+static struct validate_cursor validate_at;
+static pthread_mutex_t validate_mut = PTHREAD_MUTEX_INITIALIZER; //przed mut shardów
+
+// Wątek walidacji w tle
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mut;
+    pthread_cond_t wake;
+    bool running;       //wątek ma sprawdzać dalej, zeruje go też sam wątek po znalezieniu błędu
+    bool started;       //wątek utworzony i jeszcze nie połączony przez pthread_join
+    int percent;        //budżet CPU wątku, % jednego procesora
+    int result;         //pierwszy błąd, 0 - sterta poprawna
+} validator = { .mut = PTHREAD_MUTEX_INITIALIZER };
+
+// Sumy kontrolne nagłówków
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static bool crc_hw;     //instrukcja crc32 z SSE4.2
+
+// Bloki w obszarze mmap, posortowane rosnąco wg adresu
+static struct block_meta *mapped = NULL;
 
 struct memory_fence_t {
     uint8_t first_page[PAGE_SIZE];
@@ -43,55 +336,192 @@ struct mm_struct {
     // Poniższe pola nie należą do standardowej struktury mm_struct
     struct memory_fence_t fence;
     intptr_t start_mmap;
+    intptr_t mmap_low;  // Najniższy adres obszaru mmap, rośnie w dół od start_mmap
+    intptr_t end_shards; // Koniec obszarów shardów 1..N-1, leżących za start_mmap
+    size_t pages_available; // Liczba stron zarezerwowanych dla sterty
 } mm;
 
-void __attribute__((constructor)) memory_init(void)
+static size_t memory_reserve_pages(void) {
+    //
+    // Rozmiar rezerwacji ze zmiennej środowiskowej, w bajtach z opcjonalnym przyrostkiem K, M lub G
+    const char *value = getenv(RESERVE_ENV);
+    if (!value)
+        return PAGES_AVAILABLE;
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': size <<= 10; //fallthrough
+        case 'M': case 'm': size <<= 10; //fallthrough
+        case 'K': case 'k': size <<= 10;
+    }
+    if (size < PAGE_SIZE)
+        return PAGES_AVAILABLE;
+    return (size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static void memory_tables_clear(void)
+{
+    madvise(page_tables, page_tables_size, MADV_DONTNEED); // strony wracają wyzerowane
+}
+
+static int memory_reserve(size_t pages)
 {
+    //
+    // Zarezerwuj przestrzeń adresową bez pamięci, pamięć dostają tylko płotki
+    size_t total = RESERVED_PAGES(pages);
+    size_t length = (total + 2 * PAGE_FENCE) * PAGE_SIZE;
+    uint8_t *raw = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+        return -1;
+
+    //
+    // Początek sterty na granicy strony ogromnej, nadmiar rezerwacji wraca od razu
+    uint8_t *area = (uint8_t *)((((uintptr_t)raw + PAGE_FENCE * PAGE_SIZE + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1)) - PAGE_FENCE * PAGE_SIZE);
+    if (area != raw)
+        munmap(raw, area - raw);
+    munmap(area + length, raw + HUGE_PAGE_SIZE - area);
+    size_t tables = total * (3 * sizeof(struct block_meta *) + 2 * sizeof(uint32_t) + sizeof(bool));
+    tables = (tables + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    void *table_area = mmap(NULL, tables, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table_area == MAP_FAILED) {
+        munmap(area, length);
+        return -1;
+    }
+    mprotect(area, PAGE_FENCE * PAGE_SIZE, PROT_READ | PROT_WRITE);
+    mprotect(area + (PAGE_FENCE + total) * PAGE_SIZE, PAGE_FENCE * PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+    //
+    // Ustaw płotki
+    memory = area;
+    mm.pages_available = pages;
+    memcpy(memory, mm.fence.first_page, PAGE_SIZE);
+    memcpy(memory + (PAGE_FENCE + total) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
+
+    //
+    // Inicjuj strukturę opisującą pamięć procesu (symulację tej struktury)
+    mm.start_brk = (intptr_t)(memory + PAGE_SIZE);
+    mm.brk = (intptr_t)(memory + PAGE_SIZE);
+    mm.start_mmap = (intptr_t)(memory + (PAGE_FENCE + pages) * PAGE_SIZE);
+    mm.mmap_low = mm.start_mmap;
+    mm.end_shards = (intptr_t)(memory + (PAGE_FENCE + total) * PAGE_SIZE);
+
+    page_tables = table_area;
+    page_tables_size = tables;
+    page_map = table_area;
+    large_tables = page_map + total;
+    large_free_tables = large_tables + total;
+    large_pos = (uint32_t *)(large_free_tables + total);
+    large_free_pos = large_pos + total;
+    slab_pages = (bool *)(large_free_pos + total);
+    return 0;
+}
+
+static void memory_release(void)
+{
+    munmap(memory, (RESERVED_PAGES(mm.pages_available) + 2 * PAGE_FENCE) * PAGE_SIZE);
+    munmap(page_tables, page_tables_size);
+    memory = NULL;
+    page_tables = NULL;
+}
+
+static int memory_commit(intptr_t from, intptr_t to)
+{
+    //
+    // Strony w [from, to) dostają pamięć
+    intptr_t start = (from + PAGE_SIZE - 1) & ~(intptr_t)(PAGE_SIZE - 1);
+    intptr_t end = (to + PAGE_SIZE - 1) & ~(intptr_t)(PAGE_SIZE - 1);
+    if (start >= end)
+        return 0;
+    if (mprotect((void *)start, end - start, PROT_READ | PROT_WRITE) != 0)
+        return -1;
+    if (huge_pages)
+        madvise((void *)start, end - start, MADV_HUGEPAGE); // bez THP w jądrze zostają zwykłe strony
+    return 0;
+}
+
+static void memory_decommit(intptr_t from, intptr_t to)
+{
+    //
+    // Strony w [from, to) wracają do systemu
+    intptr_t start = (from + PAGE_SIZE - 1) & ~(intptr_t)(PAGE_SIZE - 1);
+    intptr_t end = (to + PAGE_SIZE - 1) & ~(intptr_t)(PAGE_SIZE - 1);
+    if (start >= end)
+        return;
+    madvise((void *)start, end - start, MADV_DONTNEED);
+    mprotect((void *)start, end - start, PROT_NONE);
+}
+
+#if defined(MEMMANAGER_PRELOAD)
+#define MEMORY_INIT_ATTR    // Biblioteka LD_PRELOAD inicjuje pamięć przy pierwszej alokacji
+#else
+#define MEMORY_INIT_ATTR __attribute__((constructor))
+#endif
+
+void MEMORY_INIT_ATTR memory_init(void)
+{
+    if (memory)
+        return;
+#if !defined(MEMMANAGER_PRELOAD)
     //
     // Inicjuj testy
     setvbuf(stdout, NULL, _IONBF, 0); 
     srand(time(NULL));
+#endif
     assert(sizeof(intptr_t) == sizeof(void*));
     
     /*
      * Architektura przestrzeni dynamicznej dla sterty, z płotkami pamięci:
      * 
-     *  |<-   PAGES_AVAILABLE            ->|
-     * ......................................
-     * FppppppppppppppppppppppppppppppppppppL
+     *  |<-   mm.pages_available         ->|<- shardy 1..N-1 ->|
+     * .........................................................
+     * FppppppppppppppppppppppppppppppppppppSSSSSSSSSSSSSSSSSSSSL
      * 
      * F - płotek początku
      * L - płotek końca
      * p - strona do użycia (liczba stron nie jest znana)
+     * S - obszary shardów 1..N-1, każdy wielkości mm.pages_available
+     *
+     * Przestrzeń jest rezerwowana przez mmap bez dostępu (RESERVE_ENV albo PAGES_AVAILABLE stron),
+     * strony dostają pamięć dopiero gdy sięgnie po nie custom_sbrk lub obszar mmap
      */
     
     //
     // Inicjuj płotki
+    unsigned seed = time(NULL) ^ (uintptr_t)&mm; // własny stan, rand() programu pozostaje nietknięty
     for (int i = 0; i < PAGE_SIZE; i++) {
-        mm.fence.first_page[i] = rand();
-        mm.fence.last_page[i] = rand();
+        mm.fence.first_page[i] = rand_r(&seed);
+        mm.fence.last_page[i] = rand_r(&seed);
     }
     
     //
-    // Ustaw płotki
-    memcpy(memory, mm.fence.first_page, PAGE_SIZE);
-    memcpy(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
-
-    //
-    // Inicjuj strukturę opisującą pamięć procesu (symulację tej struktury)
-    mm.start_brk = (intptr_t)(memory + PAGE_SIZE);
-    mm.brk = (intptr_t)(memory + PAGE_SIZE);
-    mm.start_mmap = (intptr_t)(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE);
+    // Zarezerwuj przestrzeń i ustaw płotki
+    if (memory_reserve(memory_reserve_pages()) != 0 && memory_reserve(PAGES_AVAILABLE) != 0)
+        return; // memory zostaje NULL, heap_setup zwróci -1
+    const char *huge = getenv(HUGE_PAGES_ENV);
+    huge_pages = huge && *huge && strcmp(huge, "0") != 0;
     
-    assert(mm.start_mmap - mm.start_brk == PAGES_AVAILABLE * PAGE_SIZE);
+    assert(mm.start_mmap - mm.start_brk == (intptr_t)(mm.pages_available * PAGE_SIZE));
 } 
 
+static size_t site_snapshot(struct debug_site **out);
+
 void __attribute__((destructor)) memory_check(void)
 {
+    if (!memory)
+        return;
+
     //
     // Sprawdź płotki
     int first = memcmp(memory, mm.fence.first_page, PAGE_SIZE);
-    int last = memcmp(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
+    int last = memcmp(memory + (PAGE_FENCE + RESERVED_PAGES(mm.pages_available)) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
+
+#if defined(MEMMANAGER_PRELOAD)
+    //
+    // Biblioteka nie pisze na stdout programu i nie czeka na ENTER
+    if (first || last)
+        fprintf(stderr, "### Płotki sterty USZKODZONE (początek: %s, koniec: %s)\n", first ? "tak" : "nie", last ? "tak" : "nie");
+    return;
+#endif
     
     printf("\n### Stan płotków przestrzeni sterty:\n");
     printf("    Płotek początku: [%s]\n", first == 0 ? "poprawny" : "USZKODZONY");
@@ -100,6 +530,22 @@ void __attribute__((destructor)) memory_check(void)
     printf("### Podsumowanie: \n");
         printf("    Całkowita przestrzeni pamięci....: %lu bajtów\n", mm.start_mmap - mm.start_brk);
         printf("    Pamięć zarezerwowana przez sbrk(): %lu bajtów\n", mm.brk - mm.start_brk);
+
+    //
+    // Wycieki: bloki debugowe zajęte do końca programu, wg miejsca alokacji
+    struct debug_site *sites;
+    size_t sites_count = site_snapshot(&sites), leaked = 0, leaked_bytes = 0;
+    for (size_t i = 0; i < sites_count; i++) {
+        leaked += sites[i].count;
+        leaked_bytes += sites[i].bytes;
+    }
+    if (leaked) {
+        printf("### Wycieki pamięci: %zu bloków debugowych, %zu bajtów\n", leaked, leaked_bytes);
+        for (size_t i = 0; i < sites_count && i < DEBUG_SITE_REPORT && sites[i].count; i++)
+            printf("    %.30s:%d - %zu bloków, %zu bajtów\n", sites[i].filename, sites[i].fileline, sites[i].count, sites[i].bytes);
+    }
+    if (sites)
+        munmap(sites, sites_count * sizeof(struct debug_site));
     
     //if (first || last) {
         printf("Naciśnij ENTER...");
@@ -111,7 +557,6 @@ void __attribute__((destructor)) memory_check(void)
 //
 //
 
-
 void* custom_sbrk(intptr_t delta)
 {
     intptr_t current_brk = mm.brk;
@@ -119,704 +564,2521 @@ void* custom_sbrk(intptr_t delta)
         errno = 0;
         return (void*)current_brk;
     }
-    
-    if (mm.brk + delta >= mm.start_mmap) {
+
+    if (mm.brk + delta >= mm.mmap_low) {
         errno = ENOMEM;
         return (void*)-1;
     }
+    if (delta > 0 && memory_commit(mm.brk, mm.brk + delta) != 0) {
+        errno = ENOMEM;
+        return (void*)-1;
+    }
+    if (delta < 0)
+        memory_decommit(mm.brk + delta, mm.brk);
     mm.brk += delta;
     return (void*)current_brk;
 }
 
-int heap_setup(void) {
-    if(heap != NULL && heap_validate() != 0)
-        return -1;
-    size_t pages;
-    if(heap != NULL) { //RESET MODE
-        pages = (heap_get_used_space() + heap_get_free_space()) / PAGE_SIZE;
-        for(size_t i = 0; i < pages - 1; ++i)
-            custom_sbrk(-PAGE_SIZE);
-        heap->size = PAGE_SIZE - sizeof(struct block_meta);
-        heap->prev = NULL;
-        heap->next = NULL;
-        heap->empty = true;
-        heap->start_fence = START_VAL;
-        heap->end_fence = END_VAL;
+//
+// BLOCK COUNTERS
+//
+
+static void size_counts_add(struct size_counts *counts, size_t size) {
+    if(!counts->count[size]++) {
+        counts->map[size / 64] |= 1ULL << (size % 64);
+        counts->summary |= 1ULL << (size / 64);
+    }
+}
+
+static void size_counts_remove(struct size_counts *counts, size_t size) {
+    if(!--counts->count[size]) {
+        counts->map[size / 64] &= ~(1ULL << (size % 64));
+        if(!counts->map[size / 64])
+            counts->summary &= ~(1ULL << (size / 64));
+    }
+}
+
+static size_t size_counts_max(const struct size_counts *counts) {
+    if(!counts->summary)
         return 0;
+    int word = 63 - __builtin_clzll(counts->summary);
+    return word * 64 + 63 - __builtin_clzll(counts->map[word]);
+}
+
+static void large_swap(struct block_meta **heap, uint32_t *pos, size_t a, size_t b) {
+    struct block_meta *temp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = temp;
+    pos[PAGE_INDEX(heap[a])] = a;
+    pos[PAGE_INDEX(heap[b])] = b;
+}
+
+static void large_sift(struct block_meta **heap, uint32_t *pos, size_t count, size_t at) {
+    while(at > 0 && heap[(at - 1) / 2]->size < heap[at]->size) {
+        large_swap(heap, pos, at, (at - 1) / 2);
+        at = (at - 1) / 2;
+    }
+    for(;;) {
+        size_t largest = at;
+        size_t left = 2 * at + 1, right = 2 * at + 2;
+        if(left < count && heap[left]->size > heap[largest]->size)
+            largest = left;
+        if(right < count && heap[right]->size > heap[largest]->size)
+            largest = right;
+        if(largest == at)
+            return;
+        large_swap(heap, pos, at, largest);
+        at = largest;
     }
-    pthread_mutex_init(&mut, NULL);
-    heap = custom_sbrk(PAGE_SIZE);
-    if((void *)heap == (void *)-1)
-        return -1;
-    heap->size = PAGE_SIZE - sizeof(struct block_meta);
-    heap->prev = NULL;
-    heap->next = NULL;
-    heap->empty = true;
-    heap->start_fence = START_VAL;
-    heap->end_fence = END_VAL;
-    return 0;
 }
 
-void* heap_malloc(size_t count) {
-    if(!count)
-        return NULL;
-    pthread_mutex_lock(&mut);
-    struct block_meta *curr = heap;
-    struct block_meta *last = heap;
-    struct block_meta *next_old;
-
-    // FIND EMPTY BLOCK AND SPLIT (IF NEEDED)
-    while(curr) {
-        if(curr->empty && (curr->size > count + META_SIZE || curr->size == count)) {
-            curr->empty = false;
-
-            if(curr->size > count + META_SIZE) {
-                next_old = curr->next;
-                curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-                if(next_old)
-                    next_old->prev = curr->next;
-                curr->next->empty = true;
-                curr->next->size = curr->size - META_SIZE - count;
-                curr->next->next = next_old;
-                curr->next->prev = curr;
-                curr->next->end_fence = END_VAL;
-                curr->next->start_fence = START_VAL;
-                curr->next->debug = false;
-            }
+static void large_push(struct block_meta **heap, uint32_t *pos, size_t *count, struct block_meta *block) {
+    size_t at = (*count)++;
+    heap[at] = block;
+    pos[PAGE_INDEX(block)] = at;
+    large_sift(heap, pos, *count, at);
+}
+
+static void large_pop(struct block_meta **heap, uint32_t *pos, size_t *count, struct block_meta *block) {
+    size_t at = pos[PAGE_INDEX(block)];
+    size_t last = --*count;
+    if(at != last) {
+        large_swap(heap, pos, at, last);
+        large_sift(heap, pos, *count, at);
+    }
+}
+
+static void stats_used_add(struct block_meta *block) {
+    shard->counters.used_bytes += block->size;
+    ++shard->counters.used_blocks;
+    if(block->size < PAGE_SIZE)
+        size_counts_add(&shard->counters.small_used, block->size);
+    else //EVERY SUCH BLOCK STARTS ON ITS OWN PAGE
+        large_push(shard->large_used, large_pos, &shard->counters.large_count, block);
+}
+
+static void stats_used_remove(struct block_meta *block) {
+    shard->counters.used_bytes -= block->size;
+    --shard->counters.used_blocks;
+    if(block->size < PAGE_SIZE)
+        size_counts_remove(&shard->counters.small_used, block->size);
+    else
+        large_pop(shard->large_used, large_pos, &shard->counters.large_count, block);
+}
+
+static void stats_free_add(struct block_meta *block) {
+    shard->counters.free_bytes += block->size;
+    if(block->size >= sizeof(intptr_t))
+        ++shard->counters.free_gaps;
+    if(block->size < PAGE_SIZE)
+        size_counts_add(&shard->counters.small_free, block->size);
+    else
+        large_push(shard->large_free, large_free_pos, &shard->counters.large_free_count, block);
+}
+
+static void stats_free_remove(struct block_meta *block) {
+    shard->counters.free_bytes -= block->size;
+    if(block->size >= sizeof(intptr_t))
+        --shard->counters.free_gaps;
+    if(block->size < PAGE_SIZE)
+        size_counts_remove(&shard->counters.small_free, block->size);
+    else
+        large_pop(shard->large_free, large_free_pos, &shard->counters.large_free_count, block);
+}
+
+static size_t stats_largest_used(void) {
+    if(shard->counters.large_count)
+        return shard->large_used[0]->size;
+    return size_counts_max(&shard->counters.small_used);
+}
+
+static size_t stats_largest_free(void) {
+    if(shard->counters.large_free_count)
+        return shard->large_free[0]->size;
+    return size_counts_max(&shard->counters.small_free);
+}
+
+//
+// TLSF INDEX OF EMPTY BLOCKS
+//
+
+static void tlsf_mapping(size_t size, int *fl, int *sl) {
+    if(size < TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = (int)size;
+        return;
+    }
+    int msb = 63 - __builtin_clzll(size);
+    *fl = msb - TLSF_SL_LOG2 + 1;
+    *sl = (int)(size >> (msb - TLSF_SL_LOG2)) - TLSF_SL_COUNT;
+}
 
-            curr->size = count;
-            curr->debug = false;
-            pthread_mutex_unlock(&mut);
-            return (void *)DATA_PTR(curr);
+static void tlsf_insert(struct block_meta *block) {
+    stats_free_add(block);
+    if(block->size < MIN_FREE_SIZE)
+        return; //too small to hold the links, found only by merging
+    int fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+    struct block_meta *head = shard->tlsf.blocks[fl][sl];
+    FREE_LINKS(block)->prev_free = NULL;
+    FREE_LINKS(block)->next_free = head;
+    if(head)
+        FREE_LINKS(head)->prev_free = block;
+    shard->tlsf.blocks[fl][sl] = block;
+    shard->tlsf.fl_bitmap |= 1ULL << fl;
+    shard->tlsf.sl_bitmap[fl] |= 1U << sl;
+}
+
+static void tlsf_remove(struct block_meta *block) {
+    stats_free_remove(block);
+    if(block->size < MIN_FREE_SIZE)
+        return;
+    int fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+    struct block_meta *prev = FREE_LINKS(block)->prev_free;
+    struct block_meta *next = FREE_LINKS(block)->next_free;
+    if(next)
+        FREE_LINKS(next)->prev_free = prev;
+    if(prev)
+        FREE_LINKS(prev)->next_free = next;
+    else {
+        shard->tlsf.blocks[fl][sl] = next;
+        if(!next) {
+            shard->tlsf.sl_bitmap[fl] &= ~(1U << sl);
+            if(!shard->tlsf.sl_bitmap[fl])
+                shard->tlsf.fl_bitmap &= ~(1ULL << fl);
         }
-        last = curr;
-        curr = curr->next;
     }
-    //
+}
+
+static struct block_meta *tlsf_find(size_t size) {
+    int fl, sl;
+    tlsf_mapping(size, &fl, &sl);
+    if(fl >= TLSF_FL_COUNT)
+        return NULL;
+    //HEAD OF THE EXACT BIN MAY ALREADY FIT
+    if(shard->tlsf.blocks[fl][sl] && shard->tlsf.blocks[fl][sl]->size >= size)
+        return shard->tlsf.blocks[fl][sl];
 
-    //IF NOT FOUND, INCREASE HEAP SIZE AND SPLIT
-    curr = last;
-    struct block_meta *ptr;
-    size_t alloc_size = ceil((double)(count - curr->size + META_SIZE) / PAGE_SIZE) * PAGE_SIZE;
-    ptr = custom_sbrk(alloc_size);
-    if((void *)ptr == (void *)-1) {
-        pthread_mutex_unlock(&mut);
+    //ROUND UP SO THAT EVERY BLOCK IN THE FOUND BIN FITS
+    if(size >= TLSF_SL_COUNT)
+        size += ((size_t)1 << (63 - __builtin_clzll(size) - TLSF_SL_LOG2)) - 1;
+    tlsf_mapping(size, &fl, &sl);
+    if(fl >= TLSF_FL_COUNT)
         return NULL;
+    uint32_t sl_map = shard->tlsf.sl_bitmap[fl] & (~0U << sl);
+    if(!sl_map) {
+        uint64_t fl_map = fl + 1 < TLSF_FL_COUNT ? shard->tlsf.fl_bitmap & (~0ULL << (fl + 1)) : 0;
+        if(!fl_map)
+            return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = shard->tlsf.sl_bitmap[fl];
     }
-    curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-    curr->empty = false;
-    ptr->start_fence = START_VAL;
-    ptr->end_fence = END_VAL;
-
-    curr->next->empty = true;
-    curr->next->next = NULL;
-    curr->next->prev = curr;
-    curr->next->size = alloc_size - (count - curr->size) - META_SIZE;
-    curr->size = count;
-    curr->next->start_fence = START_VAL;
-    curr->next->end_fence = END_VAL;
-    curr->next->debug = false;
-    curr->debug = false;
-    //
-    pthread_mutex_unlock(&mut);
-    return (void *)DATA_PTR(curr);
+    sl = __builtin_ctz(sl_map);
+    return shard->tlsf.blocks[fl][sl];
+}
+
+//
+// PAGE MAP
+//
+
+static void page_map_cover(intptr_t from, intptr_t to, struct block_meta *block) {
+    //EVERY PAGE WHOSE FIRST BYTE LIES IN [from, to) POINTS AT block
+    for(intptr_t page = PAGE_INDEX(from + PAGE_SIZE - 1); page < PAGE_INDEX(to + PAGE_SIZE - 1); ++page)
+        page_map[page] = block;
+}
+
+static struct block_meta *block_find(intptr_t pointer) {
+    //THE BLOCK COVERING THE START OF THE PAGE, THEN AT MOST THE HEADERS ON THAT PAGE
+    struct block_meta *block = page_map[PAGE_INDEX(pointer)];
+    while(block->next && (intptr_t)block->next <= pointer)
+        block = block->next;
+    return block;
+}
+
+//
+// DEBUG CALL-SITE TABLES, CALLED WITH debug_mut LOCKED
+//
+
+static size_t debug_home(const struct debug_table *table, const void *key) {
+    size_t hash = ((uintptr_t)key >> 3) * 0x9E3779B97F4A7C15ULL;
+    return (hash ^ (hash >> 32)) & (table->capacity - 1);
+}
+
+static size_t debug_slot(const struct debug_table *table, const void *key) {
+    size_t slot = debug_home(table, key);
+    while(table->entries[slot].key && table->entries[slot].key != key)
+        slot = (slot + 1) & (table->capacity - 1);
+    return slot;
+}
+
+static bool debug_reserve(struct debug_table *table) {
+    if(table->entries && 2 * (table->count + 1) <= table->capacity)
+        return true;
+    size_t capacity = table->capacity ? 2 * table->capacity : DEBUG_TABLE_MIN;
+    struct debug_entry *entries = mmap(NULL, capacity * sizeof(struct debug_entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(entries == MAP_FAILED)
+        return false;
+    struct debug_table grown = { entries, capacity, table->count };
+    for(size_t i = 0; i < table->capacity; ++i)
+        if(table->entries[i].key)
+            grown.entries[debug_slot(&grown, table->entries[i].key)] = table->entries[i];
+    if(table->entries)
+        munmap(table->entries, table->capacity * sizeof(struct debug_entry));
+    *table = grown;
+    return true;
+}
+
+static size_t name_hash(const char *name, size_t *length) {
+    //FNV-1a
+    size_t hash = 0xCBF29CE484222325ULL, i = 0;
+    for(; name[i]; ++i)
+        hash = (hash ^ (uint8_t)name[i]) * 0x100000001B3ULL;
+    *length = i;
+    return hash;
+}
+
+static size_t name_slot(const struct debug_names *names, const char *name, size_t hash) {
+    size_t slot = (hash ^ (hash >> 32)) & (names->capacity - 1);
+    while(names->entries[slot].name && (names->entries[slot].hash != hash || strcmp(names->entries[slot].name, name) != 0))
+        slot = (slot + 1) & (names->capacity - 1);
+    return slot;
+}
+
+static bool name_reserve(size_t length) {
+    //NAMES ARE NEVER REMOVED, NOT EVEN BY A HEAP RESET
+    if(debug_names.area_left <= length) {
+        size_t size = length < DEBUG_NAMES_AREA ? DEBUG_NAMES_AREA : (length + PAGE_SIZE) / PAGE_SIZE * PAGE_SIZE;
+        char *area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(area == MAP_FAILED)
+            return false;
+        debug_names.area = area; //the rest of the previous area stays unused
+        debug_names.area_left = size;
+    }
+    if(debug_names.entries && 2 * (debug_names.count + 1) <= debug_names.capacity)
+        return true;
+    size_t capacity = debug_names.capacity ? 2 * debug_names.capacity : DEBUG_TABLE_MIN;
+    struct debug_name *entries = mmap(NULL, capacity * sizeof(struct debug_name), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(entries == MAP_FAILED)
+        return false;
+    struct debug_names grown = debug_names;
+    grown.entries = entries;
+    grown.capacity = capacity;
+    for(size_t i = 0; i < debug_names.capacity; ++i)
+        if(debug_names.entries[i].name)
+            grown.entries[name_slot(&grown, debug_names.entries[i].name, debug_names.entries[i].hash)] = debug_names.entries[i];
+    if(debug_names.entries)
+        munmap(debug_names.entries, debug_names.capacity * sizeof(struct debug_name));
+    debug_names = grown;
+    return true;
+}
+
+static const char *debug_intern(const char *filename) {
+    //THE CALLER'S STRING MAY LIVE ON ITS STACK OR IN A MODULE UNLOADED LATER, ONLY A COPY IS KEPT
+    size_t length, hash = name_hash(filename, &length);
+    if(debug_names.entries) {
+        struct debug_name *entry = &debug_names.entries[name_slot(&debug_names, filename, hash)];
+        if(entry->name)
+            return entry->name;
+    }
+    if(!name_reserve(length))
+        return "?";
+    char *copy = memcpy(debug_names.area, filename, length + 1);
+    debug_names.area += length + 1;
+    debug_names.area_left -= length + 1;
+    struct debug_name *entry = &debug_names.entries[name_slot(&debug_names, copy, hash)];
+    entry->name = copy;
+    entry->hash = hash;
+    ++debug_names.count;
+    return copy;
+}
+
+static size_t site_slot(const struct debug_sites *sites, const char *filename, int fileline) {
+    size_t hash = (((uintptr_t)filename >> 3) ^ (size_t)fileline * 0x9E3779B97F4A7C15ULL) * 0x9E3779B97F4A7C15ULL;
+    size_t slot = (hash ^ (hash >> 32)) & (sites->capacity - 1);
+    while(sites->entries[slot].filename && (sites->entries[slot].filename != filename || sites->entries[slot].fileline != fileline))
+        slot = (slot + 1) & (sites->capacity - 1);
+    return slot;
+}
+
+static bool site_reserve(void) {
+    //SITES ARE NEVER REMOVED, A SITE WITHOUT LIVE BLOCKS KEEPS ITS PEAK
+    if(debug_sites.entries && 2 * (debug_sites.count + 1) <= debug_sites.capacity)
+        return true;
+    size_t capacity = debug_sites.capacity ? 2 * debug_sites.capacity : DEBUG_TABLE_MIN;
+    struct debug_site *entries = mmap(NULL, capacity * sizeof(struct debug_site), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(entries == MAP_FAILED)
+        return false;
+    struct debug_sites grown = { entries, capacity, debug_sites.count };
+    for(size_t i = 0; i < debug_sites.capacity; ++i)
+        if(debug_sites.entries[i].filename)
+            grown.entries[site_slot(&grown, debug_sites.entries[i].filename, debug_sites.entries[i].fileline)] = debug_sites.entries[i];
+    if(debug_sites.entries)
+        munmap(debug_sites.entries, debug_sites.capacity * sizeof(struct debug_site));
+    debug_sites = grown;
+    return true;
+}
+
+static void site_add(const struct debug_entry *entry) {
+    if(!site_reserve())
+        return;
+    struct debug_site *site = &debug_sites.entries[site_slot(&debug_sites, entry->filename, entry->fileline)];
+    if(!site->filename) {
+        site->filename = entry->filename;
+        site->fileline = entry->fileline;
+        ++debug_sites.count;
+    }
+    ++site->count;
+    site->bytes += entry->size;
+    if(site->bytes > site->peak)
+        site->peak = site->bytes;
+}
+
+static void site_remove(const struct debug_entry *entry) {
+    if(!debug_sites.entries)
+        return;
+    struct debug_site *site = &debug_sites.entries[site_slot(&debug_sites, entry->filename, entry->fileline)];
+    if(!site->filename || !site->count) //the site did not fit when the block was added
+        return;
+    --site->count;
+    site->bytes -= entry->size;
+}
+
+static int site_compare(const void *a, const void *b) {
+    const struct debug_site *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : (x->peak < y->peak) - (x->peak > y->peak);
+}
+
+static size_t site_snapshot(struct debug_site **out) {
+    //SITES COPIED UNDER debug_mut AND SORTED BY LIVE BYTES, THE CALLER UNMAPS THE COPY
+    *out = NULL;
+    pthread_mutex_lock(&debug_mut);
+    size_t count = 0, length = debug_sites.count * sizeof(struct debug_site);
+    struct debug_site *copy = length ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if(copy != MAP_FAILED) {
+        for(size_t i = 0; i < debug_sites.capacity; ++i)
+            if(debug_sites.entries[i].filename)
+                copy[count++] = debug_sites.entries[i];
+        *out = copy;
+    }
+    pthread_mutex_unlock(&debug_mut);
+    if(count)
+        qsort(copy, count, sizeof(struct debug_site), site_compare);
+    return count;
+}
+
+static struct debug_entry *debug_lookup(const void *data) {
+    if(!debug_blocks.entries)
+        return NULL;
+    struct debug_entry *entry = &debug_blocks.entries[debug_slot(&debug_blocks, data)];
+    return entry->key ? entry : NULL;
+}
+
+static bool debug_insert(const void *data, int fileline, const char* filename, size_t size) {
+    if(!debug_reserve(&debug_blocks))
+        return false;
+    struct debug_entry *entry = &debug_blocks.entries[debug_slot(&debug_blocks, data)];
+    bool fresh = !entry->key;
+    if(fresh)
+        ++debug_blocks.count;
+    else //resized in place, possibly from another site
+        site_remove(entry);
+    entry->key = data;
+    entry->filename = debug_intern(filename);
+    entry->fileline = fileline;
+    entry->size = size;
+    site_add(entry);
+    return fresh;
+}
+
+static bool debug_remove(const void *data) {
+    if(!debug_blocks.entries)
+        return false;
+    size_t mask = debug_blocks.capacity - 1;
+    size_t slot = debug_slot(&debug_blocks, data);
+    if(!debug_blocks.entries[slot].key)
+        return false;
+    site_remove(&debug_blocks.entries[slot]);
+    //BACKWARD SHIFT KEEPS LINEAR PROBING CHAINS UNBROKEN
+    size_t next = slot;
+    for(;;) {
+        next = (next + 1) & mask;
+        const void *key = debug_blocks.entries[next].key;
+        if(!key)
+            break;
+        size_t home = debug_home(&debug_blocks, key);
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            debug_blocks.entries[slot] = debug_blocks.entries[next];
+            slot = next;
+        }
+    }
+    debug_blocks.entries[slot].key = NULL;
+    --debug_blocks.count;
+    return true;
+}
+
+//
+// HEADER CHECKSUMS, CRC32C WITH SSE4.2 OR A TABLE
+//
+
+static void crc_init(void) {
+    for(uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; ++bit)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc_soft(const uint64_t *words) {
+    uint32_t crc = ~0U;
+    for(int i = 0; i < 4; ++i)
+        for(int byte = 0; byte < 8; ++byte)
+            crc = crc_table[(crc ^ (uint8_t)(words[i] >> (byte * 8))) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("sse4.2"))) uint32_t crc_sse42(const uint64_t *words) {
+    uint64_t crc = ~0U;
+    for(int i = 0; i < 4; ++i)
+        crc = __builtin_ia32_crc32di(crc, words[i]);
+    return ~(uint32_t)crc;
+}
+#endif
+
+static uint32_t block_checksum(const struct block_meta *block) {
+    //FIELDS ONE BY ONE: THE debug AND sampled BYTE MAY BE WRITTEN BY THE OWNER MEANWHILE
+    uint64_t words[4] = {
+        block->start_fence | (uint64_t)block->empty << 8 | (uint64_t)block->mapped << 9 | (uint64_t)block->end_fence << 24,
+        (uint64_t)(intptr_t)block->prev, (uint64_t)(intptr_t)block->next, block->size
+    };
+#if defined(__x86_64__)
+    if(crc_hw)
+        return crc_sse42(words);
+#endif
+    return crc_soft(words);
+}
+
+static inline void block_seal(struct block_meta *block) {
+    block->checksum = block_checksum(block);
+}
+
+static inline bool block_intact(const struct block_meta *block) {
+    return block->checksum == block_checksum(block);
+}
+
+//
+// BLOCK HELPERS, CALLED WITH THE mut OF shard LOCKED
+//
+
+static inline void shard_dirty(intptr_t end) {
+    if(end > shard->clean)
+        shard->clean = end;
+}
+
+static void block_handed_out(struct block_meta *block, intptr_t clean) {
+    //clean AS IT WAS BEFORE THE ALLOCATION; THE LINKS MAY HAVE BEEN WRITTEN DURING IT
+    intptr_t dirty = DATA_PTR(block) + (intptr_t)MIN_FREE_SIZE;
+    alloc_dirty = (clean > dirty ? clean : dirty) - DATA_PTR(block);
+    shard_dirty(DATA_PTR(block) + (intptr_t)block->size);
+}
+
+static void block_init(struct block_meta *block, size_t size, struct block_meta *prev, struct block_meta *next) {
+    block->start_fence = START_VAL;
+    block->end_fence = END_VAL;
+    block->empty = true;
+    block->debug = false;
+    block->sampled = false;
+    block->mapped = false;
+    block->size = size;
+    block->prev = prev;
+    block->next = next;
+    if(prev) {
+        prev->next = block;
+        block_seal(prev);
+    }
+    if(next) {
+        next->prev = block;
+        block_seal(next);
+    }
+    else
+        shard->tail = block;
+    block_seal(block);
+    shard_dirty((intptr_t)block + META_SIZE + MIN_FREE_SIZE); //header and the links tlsf_insert writes
+    page_map_cover((intptr_t)block, DATA_PTR(block) + (intptr_t)size, block);
+    ++shard->counters.blocks;
+}
+
+static void block_absorb_next(struct block_meta *block) {
+    //THE CALLER SEALS block WHEN IT IS DONE WITH IT
+    struct block_meta *next = block->next;
+    --shard->counters.blocks;
+    block->size += next->size + META_SIZE;
+    page_map_cover((intptr_t)next, DATA_PTR(block) + (intptr_t)block->size, block);
+    block->next = next->next;
+    if(block->next) {
+        block->next->prev = block;
+        block_seal(block->next);
+    }
+    else
+        shard->tail = block;
+}
+
+static void block_split(struct block_meta *block, size_t count) {
+    //LEAVES block SEALED EITHER WAY
+    if(block->size < count + META_SIZE + MIN_FREE_SIZE) {
+        block_seal(block);
+        return; //remainder would be too small to reuse, keep it inside the block
+    }
+    struct block_meta *rest = (struct block_meta *)(DATA_PTR(block) + count);
+    size_t rest_size = block->size - count - META_SIZE;
+    block->size = count;
+    block_init(rest, rest_size, block, block->next);
+    if(rest->next && rest->next->empty) {
+        tlsf_remove(rest->next);
+        block_absorb_next(rest);
+        block_seal(rest);
+    }
+    tlsf_insert(rest);
+}
+
+static intptr_t shard_top(void) {
+    return shard == shards ? mm.brk : shard->brk;
+}
+
+static void *shard_sbrk(intptr_t delta) {
+    //SHARD 0 IS THE sbrk HEAP, THE OTHERS MOVE A CURSOR IN THEIR OWN AREA
+    if(shard == shards)
+        return custom_sbrk(delta);
+    intptr_t current = shard->brk;
+    if(current + delta > shard->end || (delta > 0 && memory_commit(current, current + delta) != 0))
+        return (void *)-1;
+    if(delta < 0)
+        memory_decommit(current + delta, current);
+    shard->brk += delta;
+    return (void *)current;
+}
+
+static size_t heap_extend_to(intptr_t top, size_t count, size_t unit) {
+    //THE NEW TOP LIES ON A unit BOUNDARY, SO THE CURSOR NEVER SPLITS A HUGE PAGE
+    size_t size = (((size_t)top + count + unit - 1) & ~(unit - 1)) - (size_t)top;
+    return shard_sbrk(size) != (void *)-1 ? size : 0;
+}
+
+static size_t heap_extend(size_t count) {
+    //PAD GROWS WITH THE HEAP, SO REPEATED GROWTH NEEDS FEWER sbrk CALLS
+    intptr_t top = shard_top();
+    if(count > (size_t)((shard == shards ? mm.mmap_low : shard->end) - top))
+        return 0;
+    size_t unit = huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE, size;
+    if(top_pad) {
+        size_t pad = (size_t)(top - (intptr_t)shard->heap) / 4;
+        if(pad < top_pad)
+            pad = top_pad;
+        if(count + pad > count && (size = heap_extend_to(top, count + pad, unit)))
+            return size;
+    }
+    if(unit != PAGE_SIZE && (size = heap_extend_to(top, count, unit)))
+        return size;
+    return heap_extend_to(top, count, PAGE_SIZE); //near the end of the area
+}
+
+static struct block_meta *heap_grow(size_t count) {
+    struct block_meta *tail = shard->tail;
+    size_t alloc_size;
+    if(tail->empty) {
+        if(tail->size >= count)
+            return tail;
+        alloc_size = heap_extend(count - tail->size);
+        if(!alloc_size)
+            return NULL;
+        tlsf_remove(tail);
+        page_map_cover(DATA_PTR(tail) + (intptr_t)tail->size, DATA_PTR(tail) + (intptr_t)(tail->size + alloc_size), tail);
+        tail->size += alloc_size;
+        block_seal(tail);
+        tlsf_insert(tail);
+        return tail;
+    }
+    if(count > SIZE_MAX - META_SIZE)
+        return NULL;
+    struct block_meta *block = (struct block_meta *)shard_top();
+    alloc_size = heap_extend(count + META_SIZE);
+    if(!alloc_size)
+        return NULL;
+    block_init(block, alloc_size - META_SIZE, tail, NULL);
+    tlsf_insert(block);
+    return block;
+}
+
+static struct block_meta *block_alloc(size_t count) {
+    intptr_t clean = shard->clean;
+    struct block_meta *block = tlsf_find(count);
+    if(!block)
+        block = heap_grow(count);
+    if(!block)
+        return NULL;
+    tlsf_remove(block);
+    block->empty = false;
+    block->debug = false;
+    block->sampled = false;
+    block_split(block, count);
+    block_handed_out(block, clean);
+    stats_used_add(block);
+    return block;
+}
+
+static struct block_meta *block_alloc_aligned(size_t count, size_t alignment) {
+    //WORST CASE: FULL ALIGNMENT STEP PLUS A FILLER BLOCK IN FRONT
+    size_t needed = count + alignment + META_SIZE + MIN_FREE_SIZE;
+    if(needed < count)
+        return NULL;
+    intptr_t clean = shard->clean;
+    struct block_meta *block = tlsf_find(needed);
+    if(!block)
+        block = heap_grow(needed);
+    if(!block)
+        return NULL;
+    tlsf_remove(block);
+
+    intptr_t data = (DATA_PTR(block) + alignment - 1) & ~(intptr_t)(alignment - 1);
+    if(data != DATA_PTR(block)) {
+        //PADDING BECOMES A FREE BLOCK, SO IT MUST HOLD ITS OWN HEADER AND LINKS
+        data = (DATA_PTR(block) + META_SIZE + MIN_FREE_SIZE + alignment - 1) & ~(intptr_t)(alignment - 1);
+        struct block_meta *aligned = (struct block_meta *)(data - META_SIZE);
+        block_init(aligned, DATA_PTR(block) + block->size - data, block, block->next);
+        block->size = (intptr_t)aligned - DATA_PTR(block);
+        block_seal(block);
+        tlsf_insert(block); //filler stays allocatable
+        block = aligned;
+    }
+    block->empty = false;
+    block->debug = false;
+    block->sampled = false;
+    block_split(block, count);
+    block_handed_out(block, clean);
+    stats_used_add(block);
+    return block;
+}
+
+static size_t block_alloc_batch(size_t count, size_t n, void** out) {
+    //ONE CONTIGUOUS REGION FOR THE WHOLE BATCH WHEN POSSIBLE
+    size_t total = n * (META_SIZE + count) - META_SIZE;
+    struct block_meta *block = NULL;
+    if(n <= (SIZE_MAX - META_SIZE) / (META_SIZE + count)) {
+        block = tlsf_find(total);
+        if(!block)
+            block = heap_grow(total);
+    }
+    if(!block) {
+        size_t done = 0;
+        for(; done < n && (block = block_alloc(count)); ++done)
+            out[done] = (void *)DATA_PTR(block);
+        return done;
+    }
+    tlsf_remove(block);
+    intptr_t end = DATA_PTR(block) + (intptr_t)block->size;
+    for(size_t i = 0; i < n; ++i) {
+        block->empty = false;
+        block->debug = false;
+        block->sampled = false;
+        if(i + 1 < n) { //the rest is carved further, not indexed in between
+            struct block_meta *piece = (struct block_meta *)(DATA_PTR(block) + count);
+            block->size = count;
+            block_init(piece, i + 2 < n ? count : (size_t)(end - DATA_PTR(piece)), block, block->next); //only the last piece holds the rest
+        }
+        else
+            block_split(block, count);
+        stats_used_add(block);
+        out[i] = (void *)DATA_PTR(block);
+        if(i + 1 == n)
+            shard_dirty(DATA_PTR(block) + (intptr_t)block->size);
+        block = block->next;
+    }
+    return n;
+}
+
+static void heap_shrink(void);
+static struct slab *slab_of(const void *pointer);
+
+static bool block_freed(const struct block_meta *block) {
+    //CHECKED WITHOUT THE shard'S mut, WHILE NEIGHBOURS REWRITE THE LINKS AND CHECKSUM OF THE HEADER
+    struct block_meta state = { .state = __atomic_load_n(&block->state, __ATOMIC_RELAXED) };
+    return state.empty;
+}
+
+static bool mapped_area(const void *pointer) {
+    //ALSO CALLED WITHOUT THE mut OF SHARD 0, WHICH GUARDS mmap_low
+    return (intptr_t)pointer >= __atomic_load_n(&mm.mmap_low, __ATOMIC_RELAXED) && (intptr_t)pointer < mm.start_mmap;
+}
+
+static void block_release(struct block_meta *block) {
+    if(block->empty) //double free
+        return;
+    stats_used_remove(block);
+    block->empty = true;
+
+    //MERGE WITH PHYSICAL NEIGHBOURS
+    if(block->next && block->next->empty) {
+        tlsf_remove(block->next);
+        block_absorb_next(block);
+    }
+    if(block->prev && block->prev->empty) {
+        tlsf_remove(block->prev);
+        block = block->prev;
+        block_absorb_next(block);
+    }
+    block_seal(block);
+    tlsf_insert(block);
+    //
+
+    heap_shrink();
+}
+
+static void block_release_run(struct block_meta *run) {
+    if(run->next && run->next->empty) {
+        tlsf_remove(run->next);
+        block_absorb_next(run);
+    }
+    block_seal(run);
+    tlsf_insert(run);
+}
+
+static void block_release_batch(void** ptrs, size_t n) {
+    //ADJACENT BLOCKS OF THE BATCH MERGE INTO ONE RUN BEFORE IT IS INDEXED
+    struct block_meta *run = NULL;
+    for(size_t i = 0; i < n; ++i) {
+        if(!ptrs[i] || slab_of(ptrs[i]) || mapped_area(ptrs[i]))
+            continue; //slab objects and mapped blocks are released afterwards
+        struct block_meta *block = (struct block_meta *)((intptr_t)ptrs[i] - META_SIZE);
+        if(block->empty || !block_intact(block)) //a damaged header is left alone
+            continue;
+        stats_used_remove(block);
+        block->empty = true;
+        if(run && run->next == block) {
+            block_absorb_next(run);
+            continue;
+        }
+        if(run)
+            block_release_run(run);
+        run = block;
+        if(run->prev && run->prev->empty) {
+            tlsf_remove(run->prev);
+            run = run->prev;
+            block_absorb_next(run);
+        }
+    }
+    if(run)
+        block_release_run(run);
+    heap_shrink();
+}
+
+static bool heap_release_top(size_t pad) {
+    //WHOLE PAGES ABOVE pad BYTES OF THE FREE TAIL GO BACK IN ONE CALL, HUGE PAGES STAY WHOLE
+    struct block_meta *block = shard->tail;
+    if(!block->empty || block->size <= pad)
+        return false;
+    intptr_t unit = huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    intptr_t keep = (DATA_PTR(block) + (intptr_t)pad + unit - 1) & ~(unit - 1);
+    if(keep >= DATA_PTR(block) + (intptr_t)block->size)
+        return false;
+    size_t count = DATA_PTR(block) + block->size - keep;
+    tlsf_remove(block);
+    shard_sbrk(-(intptr_t)count);
+    if(shard->clean > keep) //the pages come back zeroed
+        shard->clean = keep;
+    block->size -= count;
+    block_seal(block);
+    tlsf_insert(block);
+    return true;
+}
+
+static void heap_shrink(void) {
+    if(shard->tail->empty && shard->tail->size > trim_threshold)
+        heap_release_top(top_pad);
+}
+
+static bool block_resize(struct block_meta *block, size_t size) {
+    struct block_meta *next = block->next;
+    bool next_free = next && next->empty;
+    size_t available = block->size + (next_free ? META_SIZE + next->size : 0);
+    size_t grow = 0;
+    if(size > available) { //ONLY THE TOP OF THE HEAP CAN GROW
+        if(next_free ? next != shard->tail : block != shard->tail)
+            return false;
+        grow = heap_extend(size - available);
+        if(!grow)
+            return false;
+    }
+    stats_used_remove(block);
+    if(next_free && size > block->size) {
+        tlsf_remove(next);
+        block_absorb_next(block);
+    }
+    page_map_cover(DATA_PTR(block) + (intptr_t)block->size, DATA_PTR(block) + (intptr_t)(block->size + grow), block);
+    block->size += grow;
+    block_split(block, size);
+    shard_dirty(DATA_PTR(block) + (intptr_t)block->size);
+    stats_used_add(block);
+    heap_shrink();
+    return true;
+}
+
+//
+// LARGE BLOCKS IN THE MMAP AREA, CALLED WITH THE mut OF SHARD 0 LOCKED
+//
+
+static void mapped_pages_set(struct block_meta *block, struct block_meta *value) {
+    for(intptr_t page = PAGE_INDEX(block); page < PAGE_INDEX((intptr_t)block + MAPPED_SIZE(block)); ++page)
+        page_map[page] = value;
+}
+
+static struct block_meta *mapped_alloc(size_t count) {
+    size_t length = (META_SIZE + count + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    struct block_meta *prev = NULL, *next = mapped;
+    intptr_t start;
+
+    //FIRST HOLE LEFT BY AN UNMAPPED BLOCK
+    while(next) {
+        intptr_t hole_end = next->next ? (intptr_t)next->next : mm.start_mmap;
+        if(hole_end - ((intptr_t)next + (intptr_t)MAPPED_SIZE(next)) >= (intptr_t)length) {
+            prev = next;
+            next = next->next;
+            break;
+        }
+        next = next->next;
+    }
+    if(prev)
+        start = (intptr_t)prev + MAPPED_SIZE(prev);
+    else { //GROW DOWNWARDS
+        if((intptr_t)length > mm.mmap_low - mm.brk)
+            return NULL;
+        start = mm.mmap_low - (intptr_t)length;
+        if(memory_commit(start, mm.mmap_low) != 0)
+            return NULL;
+        __atomic_store_n(&mm.mmap_low, start, __ATOMIC_RELAXED);
+        next = mapped;
+    }
+
+    struct block_meta *block = (struct block_meta *)start;
+    block->start_fence = START_VAL;
+    block->end_fence = END_VAL;
+    block->empty = false;
+    block->debug = false;
+    block->sampled = false;
+    block->mapped = true;
+    block->size = count;
+    block->prev = prev;
+    block->next = next;
+    if(prev) {
+        prev->next = block;
+        block_seal(prev);
+    }
+    else
+        mapped = block;
+    if(next) {
+        next->prev = block;
+        block_seal(next);
+    }
+    block_seal(block);
+    mapped_pages_set(block, block);
+    ++shard->counters.blocks;
+    stats_used_add(block);
+    alloc_dirty = 0; //pages outside mapped blocks were dropped or never touched
+    return block;
+}
+
+static void mapped_release(struct block_meta *block) {
+    stats_used_remove(block);
+    --shard->counters.blocks;
+    mapped_pages_set(block, NULL);
+    size_t length = MAPPED_SIZE(block);
+    if(block->next) {
+        block->next->prev = block->prev;
+        block_seal(block->next);
+    }
+    if(block->prev) {
+        block->prev->next = block->next;
+        block_seal(block->prev);
+    }
+    else {
+        mapped = block->next;
+        intptr_t low = mm.mmap_low;
+        __atomic_store_n(&mm.mmap_low, mapped ? (intptr_t)mapped : mm.start_mmap, __ATOMIC_RELAXED);
+        memory_decommit(low, mm.mmap_low); //nothing stays committed below the lowest block
+    }
+    if((intptr_t)block >= mm.mmap_low) //pages go back to the system at once
+        madvise(block, length, MADV_DONTNEED);
+}
+
+static bool mapped_resize(struct block_meta *block, size_t size) {
+    intptr_t limit = block->next ? (intptr_t)block->next : mm.start_mmap;
+    if(DATA_PTR(block) + (intptr_t)size > limit)
+        return false;
+    size_t length = MAPPED_SIZE(block);
+    stats_used_remove(block);
+    mapped_pages_set(block, NULL);
+    block->size = size;
+    block_seal(block);
+    mapped_pages_set(block, block);
+    stats_used_add(block);
+    if(MAPPED_SIZE(block) < length)
+        madvise((uint8_t *)block + MAPPED_SIZE(block), length - MAPPED_SIZE(block), MADV_DONTNEED);
+    return true;
+}
+
+//
+// SLABS OF SMALL OBJECTS, CALLED WITH THE mut OF THEIR shard LOCKED
+//
+
+static struct slab *slab_of(const void *pointer) {
+    intptr_t address = (intptr_t)pointer;
+    if(address < mm.start_brk || address >= mm.end_shards)
+        return NULL;
+    if(!slab_pages[PAGE_INDEX(address)])
+        return NULL;
+    return (struct slab *)(address & ~(intptr_t)(PAGE_SIZE - 1));
+}
+
+static size_t slab_index(const struct slab *slab, const void *pointer) {
+    return ((intptr_t)pointer - SLAB_DATA(slab)) / slab->size;
+}
+
+static bool slab_object_used(const struct slab *slab, size_t index) {
+    //heap_free CHECKS WITHOUT mut, WHILE OTHER OBJECTS OF THE WORD CHANGE
+    return __atomic_load_n(&slab->used_map[index / 64], __ATOMIC_RELAXED) & (1ULL << (index % 64));
+}
+
+static void slab_link(struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = shard->slabs[slab->cls];
+    if(slab->next)
+        slab->next->prev = slab;
+    shard->slabs[slab->cls] = slab;
+}
+
+static void slab_unlink(struct slab *slab) {
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        shard->slabs[slab->cls] = slab->next;
+    if(slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static struct slab *slab_create(int cls) {
+    //PAGE ALIGNED DATA LETS heap_free FIND THE SLAB FROM AN OBJECT ADDRESS
+    struct block_meta *block = block_alloc_aligned(SLAB_SIZE, PAGE_SIZE);
+    if(!block)
+        return NULL;
+    struct slab *slab = (struct slab *)DATA_PTR(block);
+    memset(slab, 0, sizeof(struct slab));
+    slab->size = (cls + 1) * SLAB_STEP;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER) / slab->size;
+    slab->cls = cls;
+    for(size_t i = slab->capacity; i < sizeof(slab->used_map) * 8; ++i)
+        slab->used_map[i / 64] |= 1ULL << (i % 64);
+    slab_pages[PAGE_INDEX(slab)] = true;
+    slab_link(slab);
+    return slab;
+}
+
+static void slab_destroy(struct slab *slab) {
+    slab_unlink(slab);
+    slab_pages[PAGE_INDEX(slab)] = false;
+    block_release((struct block_meta *)((intptr_t)slab - META_SIZE));
+}
+
+static void *slab_alloc(int cls) {
+    struct slab *slab = shard->slabs[cls];
+    if(!slab && !(slab = slab_create(cls)))
+        return NULL;
+    int word = 0;
+    while(!~slab->used_map[word])
+        ++word;
+    int bit = __builtin_ctzll(~slab->used_map[word]);
+    __atomic_store_n(&slab->used_map[word], slab->used_map[word] | 1ULL << bit, __ATOMIC_RELAXED);
+    if(++slab->used == slab->capacity)
+        slab_unlink(slab); //full slabs are found only through their objects
+    return (void *)(SLAB_DATA(slab) + (intptr_t)(word * 64 + bit) * slab->size);
+}
+
+static void slab_free(void *pointer) {
+    struct slab *slab = slab_of(pointer);
+    size_t index = slab_index(slab, pointer);
+    if(!slab_object_used(slab, index)) //double free
+        return;
+    __atomic_store_n(&slab->used_map[index / 64], slab->used_map[index / 64] & ~(1ULL << (index % 64)), __ATOMIC_RELAXED);
+    if(slab->used-- == slab->capacity)
+        slab_link(slab);
+    if(!slab->used)
+        slab_destroy(slab);
+}
+
+//
+// CALL-SITE INFORMATION OF BLOCKS AND SLAB OBJECTS
+//
+
+static void pointer_set_debug(void *data, int fileline, const char* filename, size_t size) {
+    struct slab *slab = slab_of(data);
+    pthread_mutex_lock(&debug_mut);
+    if(debug_insert(data, fileline, filename, size) && slab)
+        __atomic_add_fetch(&slab->debug, 1, __ATOMIC_RELAXED);
+    if(!slab)
+        ((struct block_meta *)((intptr_t)data - META_SIZE))->debug = true;
+    pthread_mutex_unlock(&debug_mut);
+}
+
+static void pointer_clear_debug(void *data) {
+    struct slab *slab = slab_of(data);
+    struct block_meta *block = (struct block_meta *)((intptr_t)data - META_SIZE);
+    if(slab ? !__atomic_load_n(&slab->debug, __ATOMIC_RELAXED) : !block->debug)
+        return;
+    pthread_mutex_lock(&debug_mut);
+    if(debug_remove(data) && slab)
+        __atomic_sub_fetch(&slab->debug, 1, __ATOMIC_RELAXED);
+    if(!slab)
+        block->debug = false;
+    pthread_mutex_unlock(&debug_mut);
+}
+
+static void pointer_resize_debug(void *data, size_t size) {
+    //A BLOCK RESIZED IN PLACE WITHOUT A CALL SITE KEEPS ITS OLD SITE, ONLY THE SIZE CHANGES
+    struct slab *slab = slab_of(data);
+    struct block_meta *block = (struct block_meta *)((intptr_t)data - META_SIZE);
+    if(slab ? !__atomic_load_n(&slab->debug, __ATOMIC_RELAXED) : !block->debug)
+        return;
+    pthread_mutex_lock(&debug_mut);
+    struct debug_entry *entry = debug_lookup(data);
+    if(entry) {
+        site_remove(entry);
+        entry->size = size;
+        site_add(entry);
+    }
+    pthread_mutex_unlock(&debug_mut);
+}
+
+//
+// SAMPLING HEAP PROFILE, TABLE CALLED WITH sample_mut LOCKED
+//
+
+static size_t sample_home(const struct sample_table *table, const void *key) {
+    size_t hash = ((uintptr_t)key >> 3) * 0x9E3779B97F4A7C15ULL;
+    return (hash ^ (hash >> 32)) & (table->capacity - 1);
+}
+
+static size_t sample_slot(const struct sample_table *table, const void *key) {
+    size_t slot = sample_home(table, key);
+    while(table->entries[slot].key && table->entries[slot].key != key)
+        slot = (slot + 1) & (table->capacity - 1);
+    return slot;
+}
+
+static bool sample_reserve(struct sample_table *table) {
+    if(table->entries && 2 * (table->count + 1) <= table->capacity)
+        return true;
+    size_t capacity = table->capacity ? 2 * table->capacity : SAMPLE_TABLE_MIN;
+    struct sample_entry *entries = mmap(NULL, capacity * sizeof(struct sample_entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(entries == MAP_FAILED)
+        return false;
+    struct sample_table grown = { entries, capacity, table->count };
+    for(size_t i = 0; i < table->capacity; ++i)
+        if(table->entries[i].key)
+            grown.entries[sample_slot(&grown, table->entries[i].key)] = table->entries[i];
+    if(table->entries)
+        munmap(table->entries, table->capacity * sizeof(struct sample_entry));
+    *table = grown;
+    return true;
+}
+
+static void sample_remove(const void *data) {
+    size_t mask = samples.capacity - 1;
+    size_t slot = sample_slot(&samples, data);
+    if(!samples.entries[slot].key)
+        return;
+    //BACKWARD SHIFT, AS IN THE DEBUG TABLES
+    size_t next = slot;
+    for(;;) {
+        next = (next + 1) & mask;
+        const void *key = samples.entries[next].key;
+        if(!key)
+            break;
+        size_t home = sample_home(&samples, key);
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            samples.entries[slot] = samples.entries[next];
+            slot = next;
+        }
+    }
+    samples.entries[slot].key = NULL;
+    --samples.count;
+}
+
+static int64_t sample_interval(size_t rate) {
+    //EXPONENTIAL GAP WITH MEAN rate, SO SAMPLES FORM A POISSON PROCESS OVER ALLOCATED BYTES
+    if(!sample_seed)
+        sample_seed = ((uintptr_t)&sample_seed ^ (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL) | 1;
+    sample_seed ^= sample_seed << 13;
+    sample_seed ^= sample_seed >> 7;
+    sample_seed ^= sample_seed << 17;
+    double u = (double)((sample_seed >> 11) + 1) / 9007199254740992.0; //(0, 1]
+    //log2(u) FROM THE EXPONENT AND A QUADRATIC FIT OF THE MANTISSA, NO libm
+    uint64_t bits;
+    memcpy(&bits, &u, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    double mantissa;
+    memcpy(&mantissa, &bits, sizeof(mantissa));
+    mantissa -= 1.0;
+    double log2u = exponent + mantissa * (1.3465 - 0.3465 * mantissa);
+    return (int64_t)(-log2u * 0.6931471805599453 * (double)rate) + 1;
+}
+
+static void __attribute__((noinline)) sample_take(void *data, size_t count) {
+    //SLOW PATH, ONLY WHEN THE THREAD'S COUNTDOWN RUNS OUT
+    size_t rate = __atomic_load_n(&sample_rate, __ATOMIC_RELAXED);
+    if(!rate) {
+        sample_bytes = SAMPLE_IDLE;
+        sample_started = false;
+        return;
+    }
+    if(sample_busy)
+        return;
+    if(!sample_started) { //the first gap starts at this allocation
+        sample_started = true;
+        sample_bytes = sample_interval(rate) - (int64_t)count;
+        if(sample_bytes >= 0)
+            return;
+    }
+    sample_busy = true;
+    sample_bytes = sample_interval(rate);
+    struct sample_entry entry = { data, count, 0, { NULL } };
+    int depth = backtrace(entry.stack, SAMPLE_DEPTH);
+    entry.depth = depth > 1 ? depth - 1 : 0; //without sample_take itself
+    memmove(entry.stack, entry.stack + 1, entry.depth * sizeof(void *));
+    struct slab *slab = slab_of(data);
+    pthread_mutex_lock(&sample_mut);
+    if(sample_reserve(&samples)) {
+        struct sample_entry *slot = &samples.entries[sample_slot(&samples, data)];
+        if(!slot->key)
+            ++samples.count;
+        *slot = entry;
+        ++sample_total;
+        sample_total_bytes += count;
+        if(slab)
+            __atomic_add_fetch(&slab->sampled, 1, __ATOMIC_RELAXED);
+        else
+            ((struct block_meta *)((intptr_t)data - META_SIZE))->sampled = true;
+    }
+    pthread_mutex_unlock(&sample_mut);
+    sample_busy = false;
+}
+
+static inline void sample_maybe(void *data, size_t count) {
+    //THE ONLY COST WITHOUT A SAMPLE: ONE SUBTRACTION AND A BRANCH
+    if(__builtin_expect((sample_bytes -= (int64_t)count) < 0, 0) && data)
+        sample_take(data, count);
+}
+
+static void sample_forget(void *data) {
+    struct slab *slab = slab_of(data);
+    struct block_meta *block = (struct block_meta *)((intptr_t)data - META_SIZE);
+    if(slab ? !__atomic_load_n(&slab->sampled, __ATOMIC_RELAXED) : !block->sampled)
+        return;
+    pthread_mutex_lock(&sample_mut);
+    size_t count = samples.count;
+    if(samples.entries)
+        sample_remove(data);
+    if(slab && samples.count != count)
+        __atomic_sub_fetch(&slab->sampled, 1, __ATOMIC_RELAXED);
+    if(!slab)
+        block->sampled = false;
+    pthread_mutex_unlock(&sample_mut);
+}
+
+static void sample_resize(void *data, size_t size) {
+    //A BLOCK RESIZED IN PLACE KEEPS ITS SAMPLE
+    if(slab_of(data) || !((struct block_meta *)((intptr_t)data - META_SIZE))->sampled)
+        return;
+    pthread_mutex_lock(&sample_mut);
+    if(samples.entries) {
+        struct sample_entry *entry = &samples.entries[sample_slot(&samples, data)];
+        if(entry->key)
+            entry->size = size;
+    }
+    pthread_mutex_unlock(&sample_mut);
+}
+
+static void sample_env_init(void) {
+    const char *rate = getenv(PROFILE_ENV);
+    if(rate)
+        sample_rate = strtoull(rate, NULL, 10);
+}
+
+static bool profile_write(int fd, const char *text, size_t length) {
+    while(length) {
+        ssize_t written = write(fd, text, length);
+        if(written <= 0)
+            return false;
+        text += written;
+        length -= written;
+    }
+    return true;
+}
+
+//
+// SHARDS AND THEIR LOCKS
+//
+
+static struct heap_shard *shard_of(const void *pointer) {
+    //THE ADDRESS TELLS THE OWNER, THE MMAP AREA BELONGS TO SHARD 0
+    intptr_t address = (intptr_t)pointer;
+    if(address < mm.start_mmap || address >= mm.end_shards)
+        return shards;
+    return &shards[1 + (address - mm.start_mmap) / (intptr_t)(mm.pages_available * PAGE_SIZE)];
+}
+
+static bool remote_pending(const void *pointer) {
+    return ((const struct remote_entry *)pointer)->key == &remote_key;
+}
+
+static void remote_push(struct heap_shard *owner, void *first, void *last) {
+    //THE CONSUMER ONLY TAKES THE WHOLE LIST, SO A PLAIN CAS PUSH HAS NO ABA
+    struct remote_entry *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do
+        ((struct remote_entry *)last)->next = head;
+    while(!__atomic_compare_exchange_n(&owner->remote_frees, &head, (struct remote_entry *)first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void remote_release(void** ptrs, size_t n) {
+    //BLOCK RUNS FIRST, SLAB_FREE CAN RELEASE A WHOLE SLAB BLOCK
+    block_release_batch(ptrs, n);
+    for(size_t i = 0; i < n; ++i) {
+        if(slab_of(ptrs[i]))
+            slab_free(ptrs[i]);
+        else if(mapped_area(ptrs[i]) && block_intact((struct block_meta *)((intptr_t)ptrs[i] - META_SIZE)))
+            mapped_release((struct block_meta *)((intptr_t)ptrs[i] - META_SIZE));
+    }
+}
+
+static void remote_drain(void) {
+    struct remote_entry *entry = __atomic_exchange_n(&shard->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    void *batch[REMOTE_BATCH];
+    size_t n = 0;
+    while(entry) {
+        struct remote_entry *next = entry->next;
+        entry->key = NULL;
+        batch[n++] = entry;
+        if(n == REMOTE_BATCH) {
+            remote_release(batch, n);
+            n = 0;
+        }
+        entry = next;
+    }
+    remote_release(batch, n);
+}
+
+static void heap_lock(struct heap_shard *owner) {
+    pthread_mutex_lock(owner->mut);
+    shard = owner;
+    if(__atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED))
+        remote_drain();
+}
+
+static bool heap_trylock(struct heap_shard *owner) {
+    if(pthread_mutex_trylock(owner->mut) != 0)
+        return false;
+    shard = owner;
+    if(__atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED))
+        remote_drain();
+    return true;
+}
+
+static void heap_unlock(void) {
+    pthread_mutex_unlock(shard->mut);
+}
+
+static bool shard_prepare(void) {
+    //SHARDS 1..N-1 GET THEIR FIRST BLOCK WHEN A THREAD FIRST USES THEM
+    if(shard->heap)
+        return true;
+    if(shard_sbrk(PAGE_SIZE) == (void *)-1)
+        return false;
+    shard->heap = (struct block_meta *)shard->start;
+    block_init(shard->heap, PAGE_SIZE - META_SIZE, NULL, NULL);
+    tlsf_insert(shard->heap);
+    return true;
+}
+
+static void heap_lock_home(void) {
+    //THE THREAD'S SHARD, OR THE NEXT ONE NOBODY HOLDS; THE THREAD THEN STAYS THERE
+    unsigned count = __atomic_load_n(&shard_count, __ATOMIC_RELAXED);
+    if(!home || (unsigned)(home - shards) >= count)
+        home = &shards[__atomic_fetch_add(&shard_next, 1, __ATOMIC_RELAXED) % count];
+    for(unsigned i = 0; i < count; ++i) {
+        struct heap_shard *next = &shards[(home - shards + i) % count];
+        if(!heap_trylock(next))
+            continue;
+        if(shard_prepare()) {
+            home = next;
+            return;
+        }
+        heap_unlock();
+    }
+    heap_lock(home);
+    if(!shard_prepare()) {
+        heap_unlock();
+        heap_lock(home = shards);
+    }
+}
+
+static bool heap_lock_fallback(void) {
+    //A FULL SHARD 1..N-1 LEAVES THE REQUEST TO SHARD 0
+    if(shard == shards)
+        return false;
+    heap_unlock();
+    heap_lock(shards);
+    return true;
+}
+
+//
+// PER-THREAD CACHE OF SLAB OBJECTS, WORKS WITHOUT mut
+//
+
+static void tcache_release(struct tcache_entry *list) {
+    //OBJECTS GO BACK TO THE SHARDS OF THEIR SLABS, A BUSY SHARD GETS THEM THROUGH ITS QUEUE
+    while(list) {
+        struct heap_shard *owner = shard_of(list);
+        struct tcache_entry *own = NULL, *own_last = NULL, *rest = NULL;
+        while(list) {
+            struct tcache_entry *next = list->next;
+            if(shard_of(list) == owner) {
+                list->next = own;
+                own = list;
+                if(!own_last)
+                    own_last = list;
+            }
+            else {
+                list->next = rest;
+                rest = list;
+            }
+            list = next;
+        }
+        if(heap_trylock(owner)) {
+            while(own) {
+                struct tcache_entry *next = own->next;
+                slab_free(own);
+                own = next;
+            }
+            heap_unlock();
+        }
+        else {
+            //MARKED BEFORE THE PUSH, A DOUBLE FREE OF A QUEUED OBJECT IS DETECTED
+            for(struct tcache_entry *entry = own; entry; entry = entry->next)
+                ((struct remote_entry *)entry)->key = &remote_key;
+            remote_push(owner, own, own_last);
+        }
+        list = rest;
+    }
+}
+
+static void tcache_flush(void) {
+    //A THREAD NEVER WAITS FOR mut TO DROP ITS CACHE
+    if(!tcache.total || tcache.epoch != heap_epoch)
+        return;
+    struct tcache_entry *list = NULL;
+    for(int bin = 0; bin < SLAB_CLASSES; ++bin) {
+        while(tcache.bins[bin]) {
+            struct tcache_entry *entry = tcache.bins[bin];
+            tcache.bins[bin] = entry->next;
+            entry->next = list;
+            list = entry;
+        }
+        tcache.count[bin] = 0;
+    }
+    tcache.total = 0;
+    tcache_release(list);
+}
+
+static void tcache_destroy(void *arg) {
+    (void)arg;
+    tcache_flush();
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static void tcache_prepare(void) {
+    if(!tcache.registered) { //thread exit drains the cache
+        tcache.registered = true; //pthread_setspecific may allocate and come back here
+        pthread_once(&tcache_once, tcache_key_init);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    if(tcache.epoch != heap_epoch) { //objects of the previous heap are gone
+        memset(tcache.bins, 0, sizeof(tcache.bins));
+        memset(tcache.count, 0, sizeof(tcache.count));
+        tcache.total = 0;
+        tcache.epoch = heap_epoch;
+    }
+}
+
+static void tcache_push(int bin, void *object) {
+    struct tcache_entry *entry = object;
+    entry->next = tcache.bins[bin];
+    entry->key = &tcache;
+    tcache.bins[bin] = entry;
+    ++tcache.count[bin];
+    ++tcache.total;
+}
+
+static void *tcache_get(size_t count) {
+    tcache_prepare();
+    int bin = (count - 1) / SLAB_STEP;
+    struct tcache_entry *entry = tcache.bins[bin];
+    if(entry) {
+        tcache.bins[bin] = entry->next;
+        --tcache.count[bin];
+        --tcache.total;
+        entry->key = NULL;
+        return entry;
+    }
+
+    //REFILL THE WHOLE BATCH UNDER ONE LOCK
+    void *batch[TCACHE_REFILL];
+    int filled = 0;
+    heap_lock_home();
+    do {
+        while(filled < TCACHE_REFILL && (batch[filled] = slab_alloc(bin)))
+            ++filled;
+    } while(!filled && heap_lock_fallback());
+    heap_unlock();
+    while(filled > 1) //pushed backwards, so objects come out in address order
+        tcache_push(bin, batch[--filled]);
+    return filled ? batch[0] : NULL;
+}
+
+static bool tcache_contains(void *object, int bin) {
+    if(((struct tcache_entry *)object)->key != &tcache || tcache.epoch != heap_epoch)
+        return false;
+    for(struct tcache_entry *entry = tcache.bins[bin]; entry; entry = entry->next)
+        if(entry == object)
+            return true;
+    return false;
+}
+
+static void tcache_put(void *object, int bin) {
+    tcache_prepare();
+
+    //HALF OF A FULL CLASS GOES BACK UNDER ONE LOCK PER SHARD
+    if(tcache.count[bin] >= TCACHE_LIMIT) {
+        struct tcache_entry *first = tcache.bins[bin], *last = first;
+        unsigned count = tcache.count[bin] - TCACHE_LIMIT / 2;
+        for(unsigned i = 1; i < count; ++i)
+            last = last->next;
+        tcache.bins[bin] = last->next;
+        tcache.count[bin] -= count;
+        tcache.total -= count;
+        last->next = NULL;
+        tcache_release(first);
+    }
+    tcache_push(bin, object);
+}
+
+static void *heap_alloc(size_t count) {
+    if(count <= SLAB_MAX_SIZE)
+        return tcache_get(count);
+    struct block_meta *block = NULL;
+    if(count >= MMAP_THRESHOLD) {
+        heap_lock(shards);
+        block = mapped_alloc(count);
+    }
+    else
+        heap_lock_home();
+    if(!block)
+        block = block_alloc(count);
+    if(!block && heap_lock_fallback())
+        block = block_alloc(count);
+    heap_unlock();
+    return block ? (void *)DATA_PTR(block) : NULL;
+}
+
+static void *heap_alloc_aligned(size_t count) {
+    heap_lock_home();
+    struct block_meta *block = block_alloc_aligned(count, PAGE_SIZE);
+    if(!block && heap_lock_fallback())
+        block = block_alloc_aligned(count, PAGE_SIZE);
+    heap_unlock();
+    return block ? (void *)DATA_PTR(block) : NULL;
+}
+
+static void *heap_alloc_zeroed(size_t count, bool aligned) {
+    //ONLY THE PART OF THE BLOCK THAT MAY STILL HOLD OLD DATA IS CLEARED, SLAB OBJECTS ALWAYS ARE
+    void *ptr = aligned ? heap_alloc_aligned(count) : heap_alloc(count);
+    size_t dirty = !aligned && count <= SLAB_MAX_SIZE ? count : alloc_dirty;
+    if(ptr)
+        memset(ptr, 0, dirty < count ? dirty : count);
+    return ptr;
+}
+
+static size_t heap_usable_size(void *memblock) {
+    struct slab *slab = slab_of(memblock);
+    return slab ? slab->size : ((struct block_meta *)((intptr_t)memblock - META_SIZE))->size;
+}
+
+static bool heap_resize(void* memblock, size_t size) {
+    struct slab *slab = slab_of(memblock);
+    if(slab) //an object keeps its size class
+        return size <= slab->size;
+    struct block_meta *block = (struct block_meta *)((intptr_t)memblock - META_SIZE);
+    heap_lock(shard_of(block));
+    bool resized = block->mapped ? mapped_resize(block, size) : block_resize(block, size);
+    heap_unlock();
+    return resized;
+}
+
+//
+// ALLOCATION TRACE, RECORDS APPENDED WITH trace_mut LOCKED
+//
+
+static uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_flush(void) {
+    const char *data = (const char *)trace_buffer;
+    size_t left = trace_count * sizeof(struct heap_trace_record);
+    while(left) {
+        ssize_t written = write(trace_fd, data, left);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            break;
+        data += written;
+        left -= written;
+    }
+    trace_count = 0;
+}
+
+static void trace_append(int op, size_t size, size_t alignment, const void *pointer, const void *result) {
+    if(!trace_on)
+        return;
+    if(!trace_thread)
+        trace_thread = syscall(SYS_gettid);
+    struct heap_trace_record *record = &trace_buffer[trace_count++];
+    record->timestamp = trace_clock() - trace_start;
+    record->size = size;
+    record->pointer = (uintptr_t)pointer;
+    record->result = (uintptr_t)result;
+    record->thread = trace_thread;
+    record->op = op;
+    record->alignment_log2 = alignment > 1 ? __builtin_ctzl(alignment) : 0;
+    record->reserved = 0;
+    if(trace_count == TRACE_BUFFER)
+        trace_flush();
+}
+
+static bool trace_begin(void) {
+    //ONLY THE OUTERMOST CALL IS RECORDED
+    if(!__atomic_load_n(&trace_on, __ATOMIC_RELAXED) || trace_nested)
+        return false;
+    trace_nested = true;
+    return true;
+}
+
+static void trace_end(bool traced, int op, size_t size, size_t alignment, const void *pointer, const void *result) {
+    //ALLOCATIONS ARE RECORDED AFTER THE CALL, FREES BEFORE IT, SO A REUSED ADDRESS NEVER COMES FIRST
+    if(!traced)
+        return;
+    trace_nested = false;
+    pthread_mutex_lock(&trace_mut);
+    trace_append(op, size, alignment, pointer, result);
+    pthread_mutex_unlock(&trace_mut);
+}
+
+static bool trace_begin_locked(void) {
+    //A BLOCK MOVED BY REALLOC CAN BE REUSED BY ANOTHER THREAD, THE WHOLE CALL HOLDS trace_mut
+    if(!trace_begin())
+        return false;
+    pthread_mutex_lock(&trace_mut);
+    return true;
+}
+
+static void trace_end_locked(bool traced, int op, size_t size, size_t alignment, const void *pointer, const void *result) {
+    if(!traced)
+        return;
+    trace_nested = false;
+    trace_append(op, size, alignment, pointer, result);
+    pthread_mutex_unlock(&trace_mut);
+}
+
+static void trace_batch(bool traced, int op, size_t size, void** ptrs, size_t n) {
+    if(!traced)
+        return;
+    trace_nested = false;
+    pthread_mutex_lock(&trace_mut);
+    for(size_t i = 0; i < n; ++i)
+        if(ptrs[i])
+            trace_append(op, size, 0, op == trace_free ? ptrs[i] : NULL, op == trace_free ? NULL : ptrs[i]);
+    pthread_mutex_unlock(&trace_mut);
+}
+
+static void trace_env_init(void) {
+    const char *path = getenv(TRACE_ENV);
+    if(path && *path && heap_trace_start(path) == 0)
+        atexit(heap_trace_stop);
+}
+
+//
+//
+//
+
+static void heap_fork_prepare(void) {
+    pthread_mutex_lock(&validate_mut);
+    pthread_mutex_lock(&trace_mut);
+    for(int i = 0; i < SHARDS_MAX; ++i)
+        pthread_mutex_lock(shards[i].mut);
+    pthread_mutex_lock(&debug_mut);
+    pthread_mutex_lock(&sample_mut); //the profiler samples in production, a sampling thread may hold it
+}
+
+static void heap_fork_release(void) {
+    pthread_mutex_unlock(&sample_mut);
+    pthread_mutex_unlock(&debug_mut);
+    for(int i = SHARDS_MAX - 1; i >= 0; --i)
+        pthread_mutex_unlock(shards[i].mut);
+    pthread_mutex_unlock(&trace_mut);
+    pthread_mutex_unlock(&validate_mut);
+}
+
+static void heap_fork_child(void) {
+    //RECORDS BUFFERED BEFORE THE FORK ARE WRITTEN BY THE PARENT ONLY
+    if(trace_on) {
+        close(trace_fd);
+        trace_fd = -1;
+        trace_on = false;
+        trace_count = 0;
+    }
+    validator.running = validator.started = false; //the validation thread is not forked
+    pthread_mutex_init(&validator.mut, NULL);
+    heap_fork_release();
+}
+
+static void heap_atfork_init(void) {
+    //THE CHILD MUST NOT INHERIT A LOCK HELD BY ANOTHER THREAD
+    pthread_atfork(heap_fork_prepare, heap_fork_release, heap_fork_child);
+}
+
+static void heap_clear(void) {
+    //EVERY SHARD GETS ITS SLICE OF THE RESERVATION AND STARTS UNUSED
+    for(int i = 0; i < SHARDS_MAX; ++i) {
+        struct heap_shard *s = &shards[i];
+        s->mut = i ? &shard_mut[i - 1] : &mut;
+        s->heap = s->tail = NULL;
+        __atomic_store_n(&s->remote_frees, NULL, __ATOMIC_RELAXED); //queued frees of the old heap
+        memset(&s->tlsf, 0, sizeof(s->tlsf));
+        memset(&s->counters, 0, sizeof(s->counters));
+        memset(s->slabs, 0, sizeof(s->slabs));
+        s->large_used = large_tables + i * mm.pages_available;
+        s->large_free = large_free_tables + i * mm.pages_available;
+        s->start = s->brk = i ? mm.start_mmap + (intptr_t)((i - 1) * mm.pages_available * PAGE_SIZE) : mm.start_brk;
+        s->end = s->start + (intptr_t)(mm.pages_available * PAGE_SIZE);
+        s->clean = i ? s->start : s->start + PAGE_SIZE; //the first page of shard 0 survives a reset
+    }
+    if(!shard_count) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shard_count = cpus < 1 ? 1 : cpus > SHARDS_MAX ? SHARDS_MAX : cpus;
+    }
+    memory_tables_clear();
+    pthread_mutex_lock(&debug_mut);
+    if(debug_blocks.entries)
+        memset(debug_blocks.entries, 0, debug_blocks.capacity * sizeof(struct debug_entry));
+    debug_blocks.count = 0;
+    if(debug_sites.entries)
+        memset(debug_sites.entries, 0, debug_sites.capacity * sizeof(struct debug_site));
+    debug_sites.count = 0;
+    pthread_mutex_unlock(&debug_mut);
+    pthread_mutex_lock(&sample_mut);
+    if(samples.entries)
+        memset(samples.entries, 0, samples.capacity * sizeof(struct sample_entry));
+    samples.count = 0;
+    pthread_mutex_unlock(&sample_mut);
+}
+
+int heap_setup(void) {
+    return heap_setup_reserve(0);
+}
+
+int heap_setup_reserve(size_t reserve) {
+    //A FAILED RESIZE KEEPS THE OLD RESERVATION AND LEAVES AN EMPTY, USABLE HEAP; -1 EITHER WAY
+    if(!memory) //no reservation was possible
+        return -1;
+    if(shards[0].heap != NULL && heap_validate() != 0)
+        return -1;
+    pthread_once(&crc_once, crc_init);
+    pthread_once(&trace_once, trace_env_init);
+    pthread_once(&sample_once, sample_env_init);
+    trace_end(trace_begin(), trace_reset, reserve, 0, NULL, NULL);
+    size_t pages = reserve ? (reserve + PAGE_SIZE - 1) / PAGE_SIZE : mm.pages_available;
+    if(shards[0].heap != NULL) { //RESET MODE
+        tcache_flush();
+        ++heap_epoch;
+        heap_lock(shards);
+        while(mapped)
+            mapped_release(mapped);
+        heap_unlock();
+        custom_sbrk(-(intptr_t)(mm.brk - mm.start_brk - PAGE_SIZE));
+        for(int i = 1; i < SHARDS_MAX; ++i)
+            memory_decommit(shards[i].start, shards[i].brk);
+        heap_clear();
+        shard = shards;
+        if(pages == mm.pages_available) {
+            shards[0].heap = (struct block_meta *)mm.start_brk;
+            block_init(shards[0].heap, PAGE_SIZE - sizeof(struct block_meta), NULL, NULL);
+            tlsf_insert(shards[0].heap);
+            return 0;
+        }
+        shards[0].heap = NULL;
+    }
+    bool failed = false;
+    if(pages != mm.pages_available) { //NEW RESERVATION
+        size_t old_pages = mm.pages_available;
+        memory_release();
+        if(memory_reserve(pages) != 0) {
+            if(memory_reserve(old_pages) != 0) //nothing left to set up
+                return -1;
+            failed = true;
+        }
+    }
+    heap_clear();
+    pthread_once(&atfork_once, heap_atfork_init);
+    struct block_meta *heap = custom_sbrk(PAGE_SIZE);
+    if((void *)heap == (void *)-1)
+        return -1;
+    shard = shards;
+    shards[0].heap = heap;
+    block_init(heap, PAGE_SIZE - sizeof(struct block_meta), NULL, NULL);
+    tlsf_insert(heap);
+    return failed ? -1 : 0;
+}
+
+void* heap_malloc(size_t count) {
+    bool traced = trace_begin();
+    void *ptr = count ? heap_alloc(count) : NULL;
+    sample_maybe(ptr, count);
+    trace_end(traced, trace_malloc, count, 0, NULL, ptr);
+    return ptr;
 }
 
 void* heap_calloc(size_t number, size_t size) {
-    size_t count = number * size;
-    void *ptr = heap_malloc(count);
-    if(!ptr)
+    if(size && number > SIZE_MAX / size) //number * size would wrap to a small block
         return NULL;
-    memset(ptr, 0, count);
+    bool traced = trace_begin();
+    size_t count = number * size;
+    void *ptr = count ? heap_alloc_zeroed(count, false) : NULL;
+    sample_maybe(ptr, count);
+    trace_end(traced, trace_calloc, count, 0, NULL, ptr);
     return ptr;
 }
 
 void  heap_free(void* memblock) {
     if(!memblock)
         return;
-    pthread_mutex_init(&mut, NULL);
+    trace_end(trace_begin(), trace_free, 0, 0, memblock, NULL);
+    struct slab *slab = slab_of(memblock);
+    if(slab) {
+        if(!slab_object_used(slab, slab_index(slab, memblock)) || remote_pending(memblock) || tcache_contains(memblock, slab->cls)) //double free
+            return;
+        pointer_clear_debug(memblock);
+        sample_forget(memblock);
+        tcache_put(memblock, slab->cls);
+        return;
+    }
     struct block_meta *block = (struct block_meta *)((intptr_t)memblock - META_SIZE);
-    block->empty = true;
-
-    //MERGE BLOCKS
-    struct block_meta *temp;
-    block = heap->next;
-    while(block) {
-        if(block->prev->empty && block->empty) {
-            if(block->next)
-                block->next->prev = block->prev;
-            block->prev->next = block->next;
-            block->prev->size += block->size + META_SIZE;
-            block = block->prev;
-        }
-        block = block->next;
+    bool queueable = block->size >= sizeof(struct remote_entry);
+    if(block_freed(block) || (queueable && remote_pending(memblock))) //double free
+        return;
+    pointer_clear_debug(memblock);
+    sample_forget(memblock);
+    struct heap_shard *owner = shard_of(block);
+    if(!queueable)
+        heap_lock(owner);
+    else if(!heap_trylock(owner)) { //the next holder of the shard's mut releases it
+        ((struct remote_entry *)memblock)->key = &remote_key;
+        remote_push(owner, memblock, memblock);
+        return;
     }
-    //
-
-    //RETURN MEMORY
-    block = heap;
-    intptr_t count = 0;
-    while(block->next)
-        block = block->next;
-    if(block->empty && block->size > PAGE_SIZE) {
-        count = block->size / PAGE_SIZE * PAGE_SIZE;
-        while(count) {
-            custom_sbrk(-PAGE_SIZE);
-            count -= PAGE_SIZE;
-        }
-        block->size = block->size % PAGE_SIZE;
+    if(block_intact(block)) { //links of a damaged header cannot be trusted, such a block leaks
+        if(block->mapped)
+            mapped_release(block);
+        else
+            block_release(block);
     }
-    //
-    pthread_mutex_unlock(&mut);
+    heap_unlock();
 }
 
-void* heap_realloc(void* memblock, size_t size) {
-    if(!memblock)
-        return heap_malloc(size);
+static void* heap_reallocate(void* memblock, size_t size, bool aligned, int fileline, const char* filename) {
+    //filename NULL - no call-site information
     if(!size) {
         heap_free(memblock);
         return memblock;
     }
-    void *new_block = heap_malloc(size);
-    struct block_meta *block_meta = (struct block_meta *)((intptr_t)memblock - META_SIZE);
+    bool in_place = !aligned || ((intptr_t)memblock & (intptr_t)(PAGE_SIZE - 1)) == 0; //an unaligned block must move
+    if(in_place && heap_resize(memblock, size)) {
+        sample_resize(memblock, size);
+        if(filename)
+            pointer_set_debug(memblock, fileline, filename, size);
+        else
+            pointer_resize_debug(memblock, size);
+        return memblock;
+    }
+    void *new_block;
+    if(aligned)
+        new_block = filename ? heap_malloc_aligned_debug(size, fileline, filename) : heap_malloc_aligned(size);
+    else
+        new_block = filename ? heap_malloc_debug(size, fileline, filename) : heap_malloc(size);
+    size_t usable_size = heap_usable_size(memblock);
     size_t copy_size;
     if(new_block) {
-        (block_meta->size > size) ? (copy_size = size) : (copy_size = block_meta->size);
+        (usable_size > size) ? (copy_size = size) : (copy_size = usable_size);
         memcpy(new_block, memblock, copy_size);
-        block_meta->empty = true;
         heap_free(memblock);
     }
     return new_block;
 }
 
-void* heap_malloc_debug(size_t count, int fileline, const char* filename) {
-    if(!count)
-        return NULL;
-    pthread_mutex_lock(&mut);
-    struct block_meta *curr = heap;
-    struct block_meta *last = heap;
-    struct block_meta *next_old;
-
-    // FIND EMPTY BLOCK AND SPLIT (IF NEEDED)
-    while(curr) {
-        if(curr->empty && (curr->size > count + META_SIZE || curr->size == count)) {
-            curr->empty = false;
-
-            if(curr->size > count + META_SIZE) {
-                next_old = curr->next;
-                curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-                if(next_old)
-                    next_old->prev = curr->next;
-                curr->next->empty = true;
-                curr->next->size = curr->size - META_SIZE - count;
-                curr->next->next = next_old;
-                curr->next->prev = curr;
-                curr->next->end_fence = END_VAL;
-                curr->next->start_fence = START_VAL;
-                curr->next->debug = false;
-            }
-
-            curr->size = count;
-            memset(curr->filename, 0, 31);
-            memcpy(curr->filename, filename, 30);
-            curr->debug = true;
-            curr->fileline = fileline;
-            pthread_mutex_unlock(&mut);
-            return (void *)DATA_PTR(curr);
-        }
-        last = curr;
-        curr = curr->next;
-    }
-    //
+void* heap_realloc(void* memblock, size_t size) {
+    if(!memblock)
+        return heap_malloc(size);
+    bool traced = trace_begin_locked();
+    void *ptr = heap_reallocate(memblock, size, false, 0, NULL);
+    trace_end_locked(traced, trace_realloc, size, 0, memblock, ptr);
+    return ptr;
+}
 
-    //IF NOT FOUND, INCREASE HEAP SIZE AND SPLIT
-    curr = last;
-    struct block_meta *ptr;
-    size_t alloc_size = ceil((double)(count - curr->size + META_SIZE) / PAGE_SIZE) * PAGE_SIZE;
-    ptr = custom_sbrk(alloc_size);
-    if((void *)ptr == (void *)-1) {
-        pthread_mutex_unlock(&mut);
-        return NULL;
-    }
-    curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-    curr->empty = false;
-    ptr->start_fence = START_VAL;
-    ptr->end_fence = END_VAL;
-
-    curr->next->empty = true;
-    curr->next->next = NULL;
-    curr->next->prev = curr;
-    curr->next->size = alloc_size - (count - curr->size) - META_SIZE;
-    curr->size = count;
-    curr->next->start_fence = START_VAL;
-    curr->next->end_fence = END_VAL;
-    curr->next->debug = false;
-    memset(curr->filename, 0, 31);
-    memcpy(curr->filename, filename, 30);
-    curr->debug = true;
-    curr->fileline = fileline;
-    //
-    pthread_mutex_unlock(&mut);
-    return (void *)DATA_PTR(curr);
+void* heap_malloc_debug(size_t count, int fileline, const char* filename) {
+    bool traced = trace_begin();
+    void *ptr = count ? heap_alloc(count) : NULL;
+    if(ptr)
+        pointer_set_debug(ptr, fileline, filename, count);
+    trace_end(traced, trace_malloc, count, 0, NULL, ptr);
+    return ptr;
 }
 
 void* heap_calloc_debug(size_t number, size_t size, int fileline, const char* filename) {
-    size_t count = number * size;
-    void *ptr = heap_malloc_debug(count, fileline, filename);
-    if(!ptr)
+    if(size && number > SIZE_MAX / size) //number * size would wrap to a small block
         return NULL;
-    memset(ptr, 0, count);
+    bool traced = trace_begin();
+    size_t count = number * size;
+    void *ptr = count ? heap_alloc_zeroed(count, false) : NULL;
+    if(ptr)
+        pointer_set_debug(ptr, fileline, filename, count);
+    trace_end(traced, trace_calloc, count, 0, NULL, ptr);
     return ptr;
 }
 
 void* heap_realloc_debug(void* memblock, size_t size, int fileline, const char* filename) {
     if(!memblock)
         return heap_malloc_debug(size, fileline, filename);
-    if(!size) {
-        heap_free(memblock);
-        return memblock;
-    }
-    void *new_block = heap_malloc_debug(size, fileline, filename);
-    struct block_meta *block_meta = (struct block_meta *)((intptr_t)memblock - META_SIZE);
-    size_t copy_size;
-    if(new_block) {
-        (block_meta->size > size) ? (copy_size = size) : (copy_size = block_meta->size);
-        memcpy(new_block, memblock, copy_size);
-        block_meta->empty = true;
-        heap_free(memblock);
-    }
-    return new_block;
+    bool traced = trace_begin_locked();
+    void *ptr = heap_reallocate(memblock, size, false, fileline, filename);
+    trace_end_locked(traced, trace_realloc, size, 0, memblock, ptr);
+    return ptr;
 }
 
 void* heap_malloc_aligned(size_t count) {
-    if(!count)
+    bool traced = trace_begin();
+    void *ptr = count ? heap_alloc_aligned(count) : NULL;
+    sample_maybe(ptr, count);
+    trace_end(traced, trace_malloc, count, PAGE_SIZE, NULL, ptr);
+    return ptr;
+}
+
+void* heap_calloc_aligned(size_t number, size_t size) {
+    if(size && number > SIZE_MAX / size) //number * size would wrap to a small block
         return NULL;
-    pthread_mutex_lock(&mut);
-    struct block_meta *curr = heap;
-    struct block_meta *last = heap;
-    struct block_meta *next_old, *ret_block;
-
-    int offset;
-    // FIND EMPTY BLOCK AND SPLIT (IF NEEDED)
-    while(curr) {
-        offset = PAGE_SIZE - META_SIZE - ((intptr_t)curr & (intptr_t)(PAGE_SIZE - 1));
-        if(curr->empty && (curr->size >= offset + META_SIZE + count + META_SIZE || curr->size == offset + count + META_SIZE || curr->size == count)) {
-            next_old = curr->next;
-
-            if(offset != 0) {
-                curr->next = (struct block_meta *)((intptr_t)curr + offset);
-                ret_block = curr->next;
-                if(next_old)
-                    next_old->prev = curr->next;
-                curr->next->empty = false;
-                curr->next->size = curr->size - offset - META_SIZE;
-                curr->next->next = next_old;
-                curr->next->prev = curr;
-                curr->next->end_fence = END_VAL;
-                curr->next->start_fence = START_VAL;
-                curr->next->debug = false;
-                curr->size = offset - META_SIZE;
-                if(curr->next->size > count) {
-                    curr = curr->next;
-                    curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-                    if(next_old)
-                        next_old->prev = curr->next;
-                    curr->next->empty = true;
-                    curr->next->size = curr->size - count;
-                    curr->size = count;
-                    curr->next->next = next_old;
-                    curr->next->prev = curr;
-                    curr->next->end_fence = END_VAL;
-                    curr->next->start_fence = START_VAL;
-                    curr->next->debug = false;
-                }
-            }
-            else {
-                ret_block = curr;
-                if(curr->size > count) {
-                    curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-                    if(next_old)
-                        next_old->prev = curr->next;
-                    curr->next->empty = true;
-                    curr->next->size = curr->size - META_SIZE - count;
-                    curr->next->next = next_old;
-                    curr->next->prev = curr;
-                    curr->next->end_fence = END_VAL;
-                    curr->next->start_fence = START_VAL;
-                    curr->next->debug = false;
-                    curr->size = count;
-                }
-                curr->empty = false;
-            }
+    bool traced = trace_begin();
+    size_t count = number * size;
+    void *ptr = count ? heap_alloc_zeroed(count, true) : NULL;
+    sample_maybe(ptr, count);
+    trace_end(traced, trace_calloc, count, PAGE_SIZE, NULL, ptr);
+    return ptr;
+}
 
-            ret_block->debug = false;
-            pthread_mutex_unlock(&mut);
-            return (void *)DATA_PTR(ret_block);
-        }
-        last = curr;
-        curr = curr->next;
-    }
-    //
+void* heap_realloc_aligned(void* memblock, size_t size) {
+    if(!memblock)
+        return heap_malloc_aligned(size);
+    bool traced = trace_begin_locked();
+    void *ptr = heap_reallocate(memblock, size, true, 0, NULL);
+    trace_end_locked(traced, trace_realloc, size, PAGE_SIZE, memblock, ptr);
+    return ptr;
+}
 
-    //IF NOT FOUND, INCREASE HEAP SIZE AND SPLIT
-    curr = last;
-    offset = PAGE_SIZE - META_SIZE - ((intptr_t)curr & (intptr_t)(PAGE_SIZE - 1));
-    struct block_meta *ptr;
-    size_t alloc_size = ceil((double)(META_SIZE + count + META_SIZE + offset - curr->size) / PAGE_SIZE) * PAGE_SIZE;
-    ptr = custom_sbrk(alloc_size);
-    if((void *)ptr == (void *)-1) {
-        pthread_mutex_unlock(&mut);
+void* heap_malloc_aligned_debug(size_t count, int fileline, const char* filename) {
+    //DEBUG BLOCKS ARE NEVER SAMPLED, THE SAMPLER COVERS ONLY THE NON-DEBUG heap_malloc* CALLS
+    bool traced = trace_begin();
+    void *ptr = count ? heap_alloc_aligned(count) : NULL;
+    if(ptr)
+        pointer_set_debug(ptr, fileline, filename, count);
+    trace_end(traced, trace_malloc, count, PAGE_SIZE, NULL, ptr);
+    return ptr;
+}
+
+void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename) {
+    if(size && number > SIZE_MAX / size) //number * size would wrap to a small block
         return NULL;
-    }
-    curr->size += alloc_size;
-    if(offset != 0) {
-        curr->next = (struct block_meta *)((intptr_t)curr + offset);
-        ret_block = curr->next;
-        curr->next->empty = false;
-        curr->next->size = curr->size - offset;
-        curr->next->next = NULL;
-        curr->next->prev = curr;
-        curr->next->end_fence = END_VAL;
-        curr->next->start_fence = START_VAL;
-        curr->next->debug = false;
-        curr->size = offset - META_SIZE;
-        if(curr->next->size > count) {
-            curr = curr->next;
-            curr->next = (struct block_meta *)((intptr_t)curr + META_SIZE + count);
-            curr->next->empty = true;
-            curr->next->size = curr->size - count - META_SIZE;
-            curr->size = count;
-            curr->next->next = NULL;
-            curr->next->prev = curr;
-            curr->next->end_fence = END_VAL;
-            curr->next->start_fence = START_VAL;
-            curr->next->debug = false;
-        }
-    }
-    else {
-        ret_block = curr;
-        if(curr->size > count) {
-            curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-            curr->next->empty = true;
-            curr->next->size = curr->size - META_SIZE - count;
-            curr->next->next = NULL;
-            curr->next->prev = curr;
-            curr->next->end_fence = END_VAL;
-            curr->next->start_fence = START_VAL;
-            curr->next->debug = false;
-            curr->size = count;
-        }
-        curr->empty = false;
-    }
+    bool traced = trace_begin();
+    size_t count = number * size;
+    void *ptr = count ? heap_alloc_zeroed(count, true) : NULL;
+    if(ptr)
+        pointer_set_debug(ptr, fileline, filename, count);
+    trace_end(traced, trace_calloc, count, PAGE_SIZE, NULL, ptr);
+    return ptr;
+}
 
-    ret_block->debug = false;
-    //
-    pthread_mutex_unlock(&mut);
-    return (void *)DATA_PTR(ret_block);
+void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename) {
+    if(!memblock)
+        return heap_malloc_aligned_debug(size, fileline, filename);
+    bool traced = trace_begin_locked();
+    void *ptr = heap_reallocate(memblock, size, true, fileline, filename);
+    trace_end_locked(traced, trace_realloc, size, PAGE_SIZE, memblock, ptr);
+    return ptr;
 }
 
-void* heap_calloc_aligned(size_t number, size_t size) {
-    size_t count = number * size;
-    void *ptr = heap_malloc_aligned(count);
-    if(!ptr)
+void* heap_memalign(size_t alignment, size_t count) {
+    if(!count || !alignment || (alignment & (alignment - 1))) {
+        errno = EINVAL;
         return NULL;
-    memset(ptr, 0, count);
+    }
+    bool traced = trace_begin();
+    struct block_meta *block = NULL;
+    void *ptr;
+    if(alignment == 1)
+        ptr = heap_malloc(count);
+    else {
+        heap_lock_home();
+        block = block_alloc_aligned(count, alignment);
+        if(!block && heap_lock_fallback())
+            block = block_alloc_aligned(count, alignment);
+        heap_unlock();
+        ptr = block ? (void *)DATA_PTR(block) : NULL;
+        sample_maybe(ptr, count);
+    }
+    trace_end(traced, trace_malloc, count, alignment, NULL, ptr);
+    if(!ptr)
+        errno = ENOMEM;
     return ptr;
 }
 
-void* heap_realloc_aligned(void* memblock, size_t size) {
-    if(!memblock)
-        return heap_malloc_aligned(size);
+int heap_posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if(!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *))
+        return EINVAL;
     if(!size) {
-        heap_free(memblock);
-        return memblock;
-    }
-    void *new_block = heap_malloc_aligned(size);
-    struct block_meta *block_meta = (struct block_meta *)((intptr_t)memblock - META_SIZE);
-    size_t copy_size;
-    if(new_block) {
-        (block_meta->size > size) ? (copy_size = size) : (copy_size = block_meta->size);
-        memcpy(new_block, memblock, copy_size);
-        block_meta->empty = true;
-        heap_free(memblock);
+        *memptr = NULL;
+        return 0;
     }
-    return new_block;
+    void *ptr = heap_memalign(alignment, size);
+    if(!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
 }
 
-void* heap_malloc_aligned_debug(size_t count, int fileline, const char* filename) {
-    if(!count)
-        return NULL;
-    pthread_mutex_lock(&mut);
-    struct block_meta *curr = heap;
-    struct block_meta *last = heap;
-    struct block_meta *next_old, *ret_block;
-
-    int offset;
-    // FIND EMPTY BLOCK AND SPLIT (IF NEEDED)
-    while(curr) {
-        offset = PAGE_SIZE - META_SIZE - ((intptr_t)curr & (intptr_t)(PAGE_SIZE - 1));
-        if(curr->empty && (curr->size >= offset + META_SIZE + count + META_SIZE || curr->size == offset + count + META_SIZE || curr->size == count)) {
-            next_old = curr->next;
-
-            if(offset != 0) {
-                curr->next = (struct block_meta *)((intptr_t)curr + offset);
-                ret_block = curr->next;
-                if(next_old)
-                    next_old->prev = curr->next;
-                curr->next->empty = false;
-                curr->next->size = curr->size - offset - META_SIZE;
-                curr->next->next = next_old;
-                curr->next->prev = curr;
-                curr->next->end_fence = END_VAL;
-                curr->next->start_fence = START_VAL;
-                curr->next->debug = false;
-                curr->size = offset - META_SIZE;
-                if(curr->next->size > count) {
-                    curr = curr->next;
-                    curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-                    if(next_old)
-                        next_old->prev = curr->next;
-                    curr->next->empty = true;
-                    curr->next->size = curr->size - count;
-                    curr->size = count;
-                    curr->next->next = next_old;
-                    curr->next->prev = curr;
-                    curr->next->end_fence = END_VAL;
-                    curr->next->start_fence = START_VAL;
-                    curr->next->debug = false;
-                }
-            }
-            else {
-                ret_block = curr;
-                if(curr->size > count) {
-                    curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-                    if(next_old)
-                        next_old->prev = curr->next;
-                    curr->next->empty = true;
-                    curr->next->size = curr->size - META_SIZE - count;
-                    curr->next->next = next_old;
-                    curr->next->prev = curr;
-                    curr->next->end_fence = END_VAL;
-                    curr->next->start_fence = START_VAL;
-                    curr->next->debug = false;
-                    curr->size = count;
-                }
-                curr->empty = false;
+size_t heap_malloc_batch(size_t size, size_t n, void** out) {
+    if(!size || !n || !out)
+        return 0;
+    bool traced = trace_begin();
+    size_t done = 0;
+    if(size >= MMAP_THRESHOLD) {
+        struct block_meta *block;
+        heap_lock(shards);
+        while(done < n && ((block = mapped_alloc(size)) || (block = block_alloc(size))))
+            out[done++] = (void *)DATA_PTR(block);
+    }
+    else {
+        heap_lock_home();
+        do {
+            if(size <= SLAB_MAX_SIZE) {
+                int cls = (size - 1) / SLAB_STEP;
+                while(done < n && (out[done] = slab_alloc(cls)))
+                    ++done;
             }
+            else
+                done += block_alloc_batch(size, n - done, out + done);
+        } while(done < n && heap_lock_fallback());
+    }
+    heap_unlock();
+    for(size_t i = 0; i < done; ++i)
+        sample_maybe(out[i], size);
+    for(size_t i = done; i < n; ++i)
+        out[i] = NULL;
+    trace_batch(traced, trace_malloc, size, out, done);
+    return done;
+}
+
+static bool pointer_live(void *memblock) {
+    struct slab *slab = slab_of(memblock);
+    if(slab)
+        return slab_object_used(slab, slab_index(slab, memblock)) && !remote_pending(memblock) && !tcache_contains(memblock, slab->cls);
+    struct block_meta *block = (struct block_meta *)((intptr_t)memblock - META_SIZE);
+    if(block->size >= sizeof(struct remote_entry) && remote_pending(memblock))
+        return false;
+    if(mapped_area(memblock))
+        return page_map[PAGE_INDEX(block)] == block;
+    return !block_freed(block);
+}
 
-            ret_block->debug = true;
-            ret_block->fileline = fileline;
-            memset(ret_block->filename, 0, 31);
-            memcpy(ret_block->filename, filename, 30);
-            pthread_mutex_unlock(&mut);
-            return (void *)DATA_PTR(ret_block);
+void heap_free_batch(void** ptrs, size_t n) {
+    if(!ptrs)
+        return;
+    trace_batch(trace_begin(), trace_free, 0, ptrs, n);
+    for(size_t i = 0; i < n; ++i)
+        if(ptrs[i] && pointer_live(ptrs[i])) {
+            pointer_clear_debug(ptrs[i]);
+            sample_forget(ptrs[i]);
         }
-        last = curr;
-        curr = curr->next;
+    //ONE LOCK PER RUN OF POINTERS FROM THE SAME SHARD
+    for(size_t begin = 0, end; begin < n; begin = end) {
+        struct heap_shard *owner = shard_of(ptrs[begin]);
+        for(end = begin + 1; end < n && shard_of(ptrs[end]) == owner; ++end)
+            ;
+        heap_lock(owner);
+        block_release_batch(ptrs + begin, end - begin);
+        for(size_t i = begin; i < end; ++i) {
+            if(!ptrs[i] || !(slab_of(ptrs[i]) || mapped_area(ptrs[i])) || !pointer_live(ptrs[i]))
+                continue;
+            if(slab_of(ptrs[i]))
+                slab_free(ptrs[i]);
+            else if(block_intact((struct block_meta *)((intptr_t)ptrs[i] - META_SIZE)))
+                mapped_release((struct block_meta *)((intptr_t)ptrs[i] - META_SIZE));
+        }
+        heap_unlock();
     }
-    //
+}
+
+struct heap_arena* heap_arena_create(void) {
+    struct heap_arena *arena = heap_malloc(sizeof(struct heap_arena));
+    if(!arena)
+        return NULL;
+    arena->chunks = NULL;
+    arena->top = arena->end = 0;
+    return arena;
+}
 
-    //IF NOT FOUND, INCREASE HEAP SIZE AND SPLIT
-    curr = last;
-    offset = PAGE_SIZE - META_SIZE - ((intptr_t)curr & (intptr_t)(PAGE_SIZE - 1));
-    struct block_meta *ptr;
-    size_t alloc_size = ceil((double)(META_SIZE + count + META_SIZE + offset - curr->size) / PAGE_SIZE) * PAGE_SIZE;
-    ptr = custom_sbrk(alloc_size);
-    if((void *)ptr == (void *)-1) {
-        pthread_mutex_unlock(&mut);
+void* heap_arena_alloc(struct heap_arena* arena, size_t count) {
+    if(!arena || !count)
         return NULL;
+    count = (count + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if(arena->end - arena->top < (intptr_t)count) { //NEXT CHUNK
+        size_t size = ARENA_HEADER + count > ARENA_CHUNK_SIZE ? ARENA_HEADER + count : ARENA_CHUNK_SIZE;
+        heap_lock_home();
+        struct block_meta *block = block_alloc_aligned(size, ARENA_ALIGN);
+        if(!block && heap_lock_fallback())
+            block = block_alloc_aligned(size, ARENA_ALIGN);
+        heap_unlock();
+        if(!block)
+            return NULL;
+        struct arena_chunk *chunk = (struct arena_chunk *)DATA_PTR(block);
+        chunk->next = arena->chunks;
+        chunk->size = size;
+        arena->chunks = chunk;
+        arena->top = (intptr_t)chunk + (intptr_t)ARENA_HEADER;
+        arena->end = (intptr_t)chunk + (intptr_t)size;
     }
-    curr->size += alloc_size;
-    if(offset != 0) {
-        curr->next = (struct block_meta *)((intptr_t)curr + offset);
-        ret_block = curr->next;
-        curr->next->empty = false;
-        curr->next->size = curr->size - offset;
-        curr->next->next = NULL;
-        curr->next->prev = curr;
-        curr->next->end_fence = END_VAL;
-        curr->next->start_fence = START_VAL;
-        curr->next->debug = false;
-        curr->size = offset - META_SIZE;
-        if(curr->next->size > count) {
-            curr = curr->next;
-            curr->next = (struct block_meta *)((intptr_t)curr + META_SIZE + count);
-            curr->next->empty = true;
-            curr->next->size = curr->size - count - META_SIZE;
-            curr->size = count;
-            curr->next->next = NULL;
-            curr->next->prev = curr;
-            curr->next->end_fence = END_VAL;
-            curr->next->start_fence = START_VAL;
-            curr->next->debug = false;
+    void *ptr = (void *)arena->top;
+    arena->top += count;
+    return ptr;
+}
+
+static void arena_release(struct arena_chunk *chunk) {
+    //CHUNKS OF ONE SHARD GO BACK UNDER ONE LOCK
+    struct heap_shard *owner = NULL;
+    while(chunk) {
+        struct arena_chunk *next = chunk->next;
+        if(shard_of(chunk) != owner) {
+            if(owner)
+                heap_unlock();
+            heap_lock(owner = shard_of(chunk));
         }
+        block_release((struct block_meta *)((intptr_t)chunk - META_SIZE));
+        chunk = next;
     }
-    else {
-        ret_block = curr;
-        if(curr->size > count) {
-            curr->next = (struct block_meta *)((intptr_t)curr + count + META_SIZE);
-            curr->next->empty = true;
-            curr->next->size = curr->size - META_SIZE - count;
-            curr->next->next = NULL;
-            curr->next->prev = curr;
-            curr->next->end_fence = END_VAL;
-            curr->next->start_fence = START_VAL;
-            curr->next->debug = false;
-            curr->size = count;
-        }
-        curr->empty = false;
+    if(owner)
+        heap_unlock();
+}
+
+void heap_arena_reset(struct heap_arena* arena) {
+    if(!arena || !arena->chunks)
+        return;
+    //THE CURRENT CHUNK STAYS FOR REUSE
+    struct arena_chunk *chunk = arena->chunks;
+    arena_release(chunk->next);
+    chunk->next = NULL;
+    arena->top = (intptr_t)chunk + (intptr_t)ARENA_HEADER;
+}
+
+void heap_arena_destroy(struct heap_arena* arena) {
+    if(!arena)
+        return;
+    arena_release(arena->chunks);
+    heap_free(arena);
+}
+
+int heap_mallopt(int param, int value) {
+    if(value < 0)
+        return 0;
+    int result = 1;
+    heap_lock(shards);
+    if(param == HEAP_M_TOP_PAD)
+        top_pad = value;
+    else if(param == HEAP_M_TRIM_THRESHOLD)
+        trim_threshold = value;
+    else if(param == HEAP_M_PROFILE_RATE)
+        __atomic_store_n(&sample_rate, (size_t)value, __ATOMIC_RELAXED);
+    else if(param == HEAP_M_HUGE_PAGES)
+        huge_pages = value != 0;
+    else if(param == HEAP_M_SHARDS && value >= 1 && value <= SHARDS_MAX)
+        __atomic_store_n(&shard_count, value, __ATOMIC_RELAXED);
+    else
+        result = 0;
+    heap_unlock();
+    return result;
+}
+
+int heap_trim(size_t pad) {
+    if(!shards[0].heap)
+        return 0;
+    tcache_flush();
+    bool released = false;
+    for(int i = 0; i < SHARDS_MAX; ++i) {
+        heap_lock(&shards[i]);
+        if(shard->heap && heap_release_top(pad))
+            released = true;
+        heap_unlock();
     }
+    return released;
+}
 
-    ret_block->debug = true;
-    ret_block->fileline = fileline;
-    memset(ret_block->filename, 0, 31);
-    memcpy(ret_block->filename, filename, 30);
-    //
-    pthread_mutex_unlock(&mut);
-    return (void *)DATA_PTR(ret_block);
+void heap_get_stats(struct heap_stats* stats) {
+    tcache_flush();
+    memset(stats, 0, sizeof(*stats));
+    if(!shards[0].heap)
+        return;
+    //ALL SHARDS HELD AT ONCE, TAKEN IN INDEX ORDER LIKE heap_fork_prepare, SO THE SUM IS ONE SNAPSHOT
+    for(int i = 0; i < SHARDS_MAX; ++i)
+        heap_lock(&shards[i]);
+    for(int i = 0; i < SHARDS_MAX; ++i) {
+        shard = &shards[i];
+        if(shard->heap) {
+            size_t largest_used = stats_largest_used(), largest_free = stats_largest_free();
+            stats->used_space += shard->counters.used_bytes + shard->counters.blocks * META_SIZE;
+            stats->used_blocks_count += shard->counters.used_blocks;
+            stats->free_space += shard->counters.free_bytes;
+            stats->free_gaps_count += shard->counters.free_gaps;
+            if(largest_used > stats->largest_used_block_size)
+                stats->largest_used_block_size = largest_used;
+            if(largest_free > stats->largest_free_area)
+                stats->largest_free_area = largest_free;
+        }
+    }
+    for(int i = SHARDS_MAX - 1; i >= 0; --i)
+        pthread_mutex_unlock(shards[i].mut);
 }
 
-void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename) {
-    size_t count = number * size;
-    void *ptr = heap_malloc_aligned_debug(count, fileline, filename);
-    if(!ptr)
-        return NULL;
-    memset(ptr, 0, count);
-    return ptr;
+int heap_trace_start(const char* path) {
+    struct heap_trace_header header = { HEAP_TRACE_MAGIC, sizeof(struct heap_trace_record), 0 };
+    pthread_mutex_lock(&trace_mut);
+    if(trace_on) {
+        pthread_mutex_unlock(&trace_mut);
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(trace_fd < 0 || write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        if(trace_fd >= 0)
+            close(trace_fd);
+        trace_fd = -1;
+        pthread_mutex_unlock(&trace_mut);
+        return -1;
+    }
+    trace_start = trace_clock();
+    trace_count = 0;
+    __atomic_store_n(&trace_on, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_mut);
+    return 0;
 }
 
-void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename) {
-    if(!memblock)
-        return heap_malloc_aligned_debug(size, fileline, filename);
-    if(!size) {
-        heap_free(memblock);
-        return memblock;
+void heap_trace_stop(void) {
+    pthread_mutex_lock(&trace_mut);
+    if(trace_on) {
+        trace_flush();
+        close(trace_fd);
+        trace_fd = -1;
+        __atomic_store_n(&trace_on, false, __ATOMIC_RELEASE);
     }
-    void *new_block = heap_malloc_aligned_debug(size, fileline, filename);
-    struct block_meta *block_meta = (struct block_meta *)((intptr_t)memblock - META_SIZE);
-    size_t copy_size;
-    if(new_block) {
-        (block_meta->size > size) ? (copy_size = size) : (copy_size = block_meta->size);
-        memcpy(new_block, memblock, copy_size);
-        block_meta->empty = true;
-        heap_free(memblock);
+    pthread_mutex_unlock(&trace_mut);
+}
+
+int heap_profile_dump(const char* path) {
+    //LEGACY pprof HEAP PROFILE: ONE LINE PER LIVE SAMPLE, THEN THE MAPPINGS FOR SYMBOLS
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+    char line[64 + SAMPLE_DEPTH * 20];
+    bool busy = sample_busy;
+    sample_busy = true; //allocations of the writer are not sampled
+    pthread_mutex_lock(&sample_mut);
+    size_t live_bytes = 0;
+    for(size_t i = 0; i < samples.capacity; ++i)
+        if(samples.entries[i].key)
+            live_bytes += samples.entries[i].size;
+    int length = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%llu: %llu] @ heap_v2/%zu\n", samples.count, live_bytes,
+        (unsigned long long)sample_total, (unsigned long long)sample_total_bytes, sample_rate ? sample_rate : 1);
+    bool ok = profile_write(fd, line, length);
+    for(size_t i = 0; ok && i < samples.capacity; ++i) {
+        const struct sample_entry *entry = &samples.entries[i];
+        if(!entry->key)
+            continue;
+        length = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", entry->size, entry->size);
+        for(uint32_t frame = 0; frame < entry->depth; ++frame)
+            length += snprintf(line + length, sizeof(line) - length, " %p", entry->stack[frame]);
+        line[length++] = '\n';
+        ok = profile_write(fd, line, length);
     }
-    return new_block;
+    pthread_mutex_unlock(&sample_mut);
+    if(ok)
+        ok = profile_write(fd, "\nMAPPED_LIBRARIES:\n", 20);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    ssize_t count;
+    while(ok && maps >= 0 && (count = read(maps, line, sizeof(line))) > 0)
+        ok = profile_write(fd, line, count);
+    if(maps >= 0)
+        close(maps);
+    sample_busy = busy;
+    return close(fd) == 0 && ok ? 0 : -1;
 }
 
 size_t   heap_get_used_space(void) {
-    size_t size = 0;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if(!temp->empty)
-            size += temp->size;
-        size += META_SIZE;
-        temp = temp->next;
-    }
-    return size;
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.used_space;
 }
 
 size_t   heap_get_largest_used_block_size(void) {
-    size_t size = 0;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if(temp->size > size && !temp->empty)
-            size = temp->size;
-        temp = temp->next;
-    }
-    return size;
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.largest_used_block_size;
 }
 
 uint64_t heap_get_used_blocks_count(void) {
-    uint64_t count = 0;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if(!temp->empty)
-            ++count;
-        temp = temp->next;
-    }
-    return count;
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.used_blocks_count;
 }
 
 size_t   heap_get_free_space(void) {
-    size_t size = 0;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if(temp->empty)
-            size += temp->size;
-        temp = temp->next;
-    }
-    return size;
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.free_space;
 }
 
 size_t   heap_get_largest_free_area(void) {
-    size_t size = 0;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if(temp->size > size && temp->empty)
-            size = temp->size;
-        temp = temp->next;
-    }
-    return size;
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.largest_free_area;
 }
 
 uint64_t heap_get_free_gaps_count(void) {
-    uint64_t count = 0;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if(temp->empty && temp->size >= sizeof(intptr_t))
-            ++count;
-        temp = temp->next;
-    }
-    return count;
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    return stats.free_gaps_count;
 }
 
-enum pointer_type_t get_pointer_type(const void* pointer) {
+size_t   heap_get_heap_size(void) {
+    //SBRK PART, THE MMAP AREA AND THE OTHER SHARDS, READ WITHOUT THE LOCKS
+    if(!memory)
+        return 0;
+    intptr_t brk = __atomic_load_n(&mm.brk, __ATOMIC_RELAXED);
+    intptr_t mmap_low = __atomic_load_n(&mm.mmap_low, __ATOMIC_RELAXED);
+    size_t size = (size_t)(brk - mm.start_brk) + (size_t)(mm.start_mmap - mmap_low);
+    for(int i = 1; i < SHARDS_MAX; ++i)
+        size += (size_t)(__atomic_load_n(&shards[i].brk, __ATOMIC_RELAXED) - shards[i].start);
+    return size;
+}
+
+static enum pointer_type_t slab_classify(struct slab *slab, intptr_t pointer, intptr_t *start, size_t *size) {
+    if(pointer < SLAB_DATA(slab))
+        return pointer_control_block;
+    size_t index = slab_index(slab, (void *)pointer);
+    if(index >= slab->capacity) //page tail behind the last object
+        return pointer_unallocated;
+    *start = SLAB_DATA(slab) + (intptr_t)(index * slab->size);
+    *size = slab->size;
+    if(!slab_object_used(slab, index))
+        return pointer_unallocated;
+    if(pointer == *start)
+        return pointer_valid;
+    return pointer_inside_data_block;
+}
+
+static enum pointer_type_t pointer_classify(const void* pointer, intptr_t *start, size_t *size) {
     if(!pointer)
         return pointer_null;
-    if((intptr_t)pointer < (intptr_t)heap || (intptr_t)pointer >= (intptr_t)heap + heap_get_used_space() + heap_get_free_space())
+    struct block_meta *block;
+    struct block_meta *heap = shard->heap;
+    if(heap && mapped_area(pointer)) {
+        block = page_map[PAGE_INDEX(pointer)];
+        if(!block || (intptr_t)pointer >= DATA_PTR(block) + (intptr_t)block->size)
+            return pointer_out_of_heap; //unmapped hole or page tail behind the block
+    }
+    else if(!heap || (intptr_t)pointer < (intptr_t)heap || (intptr_t)pointer >= DATA_PTR(shard->tail) + (intptr_t)shard->tail->size)
         return pointer_out_of_heap;
-    struct block_meta *temp = heap;
-    while(temp) {
-        if((intptr_t)pointer >= (intptr_t)temp && (intptr_t)pointer < (intptr_t)temp + META_SIZE)
-            return pointer_control_block;
-        if(!temp->empty && ((intptr_t)pointer > DATA_PTR(temp) && (intptr_t)pointer < DATA_PTR(temp) + temp->size))
-            return pointer_inside_data_block;
-        if(temp->empty && ((intptr_t)pointer >= DATA_PTR(temp) && (intptr_t)pointer < DATA_PTR(temp) + temp->size))
-            return pointer_unallocated;
-        temp = temp->next;
+    else {
+        struct slab *slab = slab_of(pointer);
+        if(slab && (intptr_t)pointer < (intptr_t)slab + (intptr_t)SLAB_SIZE)
+            return slab_classify(slab, (intptr_t)pointer, start, size);
+        block = block_find((intptr_t)pointer);
     }
-    return pointer_valid;
+    *start = DATA_PTR(block);
+    *size = block->size;
+    if((intptr_t)pointer < DATA_PTR(block))
+        return pointer_control_block;
+    if(block->empty)
+        return pointer_unallocated;
+    if((intptr_t)pointer == DATA_PTR(block))
+        return pointer_valid;
+    return pointer_inside_data_block;
+}
+
+enum pointer_type_t get_pointer_type(const void* pointer) {
+    intptr_t start;
+    size_t size;
+    heap_lock(shard_of(pointer));
+    enum pointer_type_t type = pointer_classify(pointer, &start, &size);
+    heap_unlock();
+    return type;
 }
 
 void* heap_get_data_block_start(const void* pointer) {
-    enum pointer_type_t type = get_pointer_type(pointer);
-    struct block_meta *temp = heap;
-    if(type == pointer_inside_data_block) {
-        while(temp) {
-            if(!temp->empty && (intptr_t)pointer > DATA_PTR(temp) && (intptr_t)pointer < DATA_PTR(temp) + temp->size)
-                return (void *)DATA_PTR(temp);
-            temp = temp->next;
-        }
-    }
-    if(type == pointer_valid)
-        return (void *)pointer;
-    return NULL;
+    intptr_t start;
+    size_t size;
+    void *found = NULL;
+    heap_lock(shard_of(pointer));
+    enum pointer_type_t type = pointer_classify(pointer, &start, &size);
+    if(type == pointer_inside_data_block || type == pointer_valid)
+        found = (void *)start;
+    heap_unlock();
+    return found;
 }
 
 size_t heap_get_block_size(const void* memblock) {
-    enum pointer_type_t type = get_pointer_type(memblock);
-    struct block_meta *temp = heap;
-    if(type == pointer_valid) {
-        while(temp) {
-            if((intptr_t)DATA_PTR(temp) == (intptr_t)memblock)
-                return temp->size;
-            temp = temp->next;
-        }
+    intptr_t start;
+    size_t size, found = 0;
+    heap_lock(shard_of(memblock));
+    if(pointer_classify(memblock, &start, &size) == pointer_valid)
+        found = size;
+    heap_unlock();
+    return found;
+}
+
+//
+// VALIDATION, EACH SHARD WALKED WITH ITS mut LOCKED
+//
+
+static int block_validate(const struct heap_shard *s, const struct block_meta *ptr) {
+    if(ptr->start_fence != START_VAL || ptr->end_fence != END_VAL)
+        return -3;
+    //THE ADDRESS FIRST, ONLY THEN IS next SAFE TO FOLLOW
+    if(ptr->next && ((intptr_t)ptr->next != (intptr_t)ptr + META_SIZE + (intptr_t)ptr->size || ptr->next->prev != ptr))
+        return -1;
+    if(!ptr->next && ptr != s->tail)
+        return -1;
+    if(!block_intact(ptr))
+        return -3;
+    struct slab *slab = slab_of((void *)DATA_PTR(ptr));
+    if(slab && (intptr_t)slab == DATA_PTR(ptr)) {
+        int used = 0;
+        for(size_t i = 0; i < sizeof(slab->used_map) / sizeof(uint64_t); ++i)
+            used += __builtin_popcountll(slab->used_map[i]);
+        if(ptr->empty || used - (int)(sizeof(slab->used_map) * 8 - slab->capacity) != slab->used)
+            return -3;
     }
     return 0;
 }
 
+static int mapped_validate(const struct block_meta *block) {
+    if(block->start_fence != START_VAL || block->end_fence != END_VAL)
+        return -3;
+    if(block->next && (block->next->prev != block || (intptr_t)block->next < (intptr_t)block + (intptr_t)MAPPED_SIZE(block)))
+        return -1;
+    if(!block_intact(block))
+        return -3;
+    return 0;
+}
+
+static int validate_list(struct validate_cursor *cursor, size_t *budget) {
+    //RESUMES AT THE BLOCK NOW HOLDING cursor->next, IT MAY HAVE BEEN MERGED OR SPLIT SINCE
+    int result = 0;
+    if(cursor->phase == validate_mapped) {
+        heap_lock(shards);
+        struct block_meta *block = mapped;
+        while(block && (intptr_t)block < cursor->next)
+            block = block->next;
+        for(; block && *budget && result == 0; block = block->next, --*budget)
+            result = mapped_validate(block);
+        cursor->next = (intptr_t)block;
+        heap_unlock();
+        return result;
+    }
+    struct heap_shard *s = &shards[cursor->phase - validate_shards];
+    heap_lock(s);
+    struct block_meta *block = s->heap;
+    if(block && cursor->next)
+        block = block_find(cursor->next < (intptr_t)s->tail ? cursor->next : (intptr_t)s->tail);
+    else if(block && block->prev != NULL)
+        result = -1;
+    for(; block && *budget && result == 0; block = block->next, --*budget)
+        result = block_validate(s, block);
+    cursor->next = (intptr_t)block;
+    heap_unlock();
+    return result;
+}
+
+static int validate_run(struct validate_cursor *cursor, size_t budget) {
+    /*
+     1  pass finished, cursor back at the start
+     0  budget used up
+    <0  as heap_validate, cursor back at the start
+    */
+    unsigned epoch = __atomic_load_n(&heap_epoch, __ATOMIC_ACQUIRE);
+    if(cursor->epoch != epoch)
+        *cursor = (struct validate_cursor){ epoch, validate_fences, 0 };
+    if(!shards[0].heap)
+        return -1;
+    int result = 0;
+    while(budget && result == 0) {
+        if(cursor->phase == validate_fences) {
+            //THE FENCES NEVER CHANGE, NO LOCK NEEDED
+            int first = memcmp(memory, mm.fence.first_page, PAGE_SIZE);
+            int last = memcmp(memory + (PAGE_FENCE + RESERVED_PAGES(mm.pages_available)) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
+            if(first != 0 || last != 0)
+                result = -2;
+            --budget;
+        }
+        else
+            result = validate_list(cursor, &budget);
+        if(result == 0 && cursor->next == 0 && ++cursor->phase == validate_shards + SHARDS_MAX)
+            result = 1;
+    }
+    if(result != 0)
+        cursor->phase = validate_fences, cursor->next = 0;
+    return result;
+}
+
 int heap_validate(void) {
     /*
      0  OK
@@ -824,51 +3086,148 @@ int heap_validate(void) {
     -2  invalid heap fences
     -3  invalid structure fences
     */
-    if(!heap)
+    struct validate_cursor cursor = { __atomic_load_n(&heap_epoch, __ATOMIC_ACQUIRE), validate_fences, 0 };
+    int result = validate_run(&cursor, SIZE_MAX);
+    return result == 1 ? 0 : result;
+}
+
+int heap_validate_step(size_t blocks) {
+    pthread_mutex_lock(&validate_mut);
+    int result = validate_run(&validate_at, blocks ? blocks : 1);
+    pthread_mutex_unlock(&validate_mut);
+    return result;
+}
+
+static uint64_t validate_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *validate_thread(void *arg) {
+    //EACH STEP IS FOLLOWED BY A PAUSE THAT KEEPS THE THREAD WITHIN ITS SHARE OF ONE CPU
+    (void)arg;
+    pthread_mutex_lock(&validator.mut);
+    while(validator.running) {
+        pthread_mutex_unlock(&validator.mut);
+        uint64_t start = validate_cpu_time();
+        int result = heap_validate_step(VALIDATE_STEP);
+        uint64_t pause = (validate_cpu_time() - start) * (100 - validator.percent) / validator.percent;
+        pthread_mutex_lock(&validator.mut);
+        if(result < 0) { //a damaged heap stays damaged
+            validator.result = result;
+            validator.running = false;
+            break;
+        }
+        if(!pause)
+            continue;
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += (time_t)((until.tv_nsec + pause) / 1000000000ULL);
+        until.tv_nsec = (long)((until.tv_nsec + pause) % 1000000000ULL);
+        while(validator.running && pthread_cond_timedwait(&validator.wake, &validator.mut, &until) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&validator.mut);
+    return NULL;
+}
+
+int heap_validate_start(int percent) {
+    if(percent < 1 || percent > 100)
         return -1;
-    int first = memcmp(memory, mm.fence.first_page, PAGE_SIZE);
-    int last = memcmp(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
-    if(first != 0 || last != 0)
-        return -2;
-    if(heap->prev != NULL)
+    pthread_mutex_lock(&validator.mut);
+    if(validator.running) {
+        pthread_mutex_unlock(&validator.mut);
         return -1;
-    struct block_meta *ptr = heap;
-    struct block_meta *ptr_prev = heap;
-    int counterFW = 0;
-    int counterBW = 0;
-    while(ptr) {
-        if(ptr->start_fence != START_VAL || ptr->end_fence != END_VAL)
-            return -3;
-        if(((intptr_t)(ptr->next) != ((intptr_t)ptr + META_SIZE + ptr->size)) && ptr->next != NULL)
-            return -1;
-        ++counterFW;
-        ptr_prev = ptr;
-        ptr = ptr->next;
     }
+    if(validator.started) { //the previous thread stopped on a damaged heap, it no longer takes mut
+        pthread_join(validator.thread, NULL);
+        pthread_cond_destroy(&validator.wake);
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&validator.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    validator.percent = percent;
+    validator.result = 0;
+    validator.running = validator.started = pthread_create(&validator.thread, NULL, validate_thread, NULL) == 0;
+    int result = validator.running ? 0 : -1;
+    pthread_mutex_unlock(&validator.mut);
+    return result;
+}
 
-    ptr = ptr_prev;
-    while(ptr) {
-        ++counterBW;
-        ptr = ptr->prev;
+int heap_validate_stop(void) {
+    pthread_mutex_lock(&validator.mut);
+    if(!validator.started) {
+        pthread_mutex_unlock(&validator.mut);
+        return validator.result;
     }
-    if(counterFW != counterBW)
-        return -1;
-    return 0;
+    validator.running = validator.started = false;
+    pthread_cond_signal(&validator.wake);
+    pthread_mutex_unlock(&validator.mut);
+    pthread_join(validator.thread, NULL);
+    pthread_cond_destroy(&validator.wake);
+    return validator.result;
 }
 
-void heap_dump_debug_information(void) {
-    struct block_meta *ptr = heap;
-    while(ptr) {
-            printf("Block address: %p, size: %zu", (void *)DATA_PTR(ptr), ptr->size);
-        if(ptr->debug && !ptr->empty)
-            printf(", allocated in: %s, line: %d", ptr->filename, ptr->fileline);
-        if(ptr->empty)
-            printf(", EMPTY");
+static void dump_block(struct block_meta *ptr) {
+        printf("Block address: %p, size: %zu", (void *)DATA_PTR(ptr), ptr->size);
+    struct debug_entry *entry = ptr->debug && !ptr->empty ? debug_lookup((void *)DATA_PTR(ptr)) : NULL;
+    if(entry)
+        printf(", allocated in: %.30s, line: %d", entry->filename, entry->fileline);
+    if(ptr->empty)
+        printf(", EMPTY");
+    if(ptr->mapped)
+        printf(", MAPPED");
+    struct slab *slab = ptr->empty ? NULL : slab_of((void *)DATA_PTR(ptr));
+    if(!slab || (intptr_t)slab != DATA_PTR(ptr)) {
         printf("\n");
-        ptr = ptr->next;
+        return;
+    }
+    printf(", SLAB: %u/%u objects of %u B\n", slab->used, slab->capacity, slab->size);
+    for(size_t i = 0; slab->debug && i < slab->capacity; ++i) {
+        intptr_t object = SLAB_DATA(slab) + (intptr_t)(i * slab->size);
+        entry = slab_object_used(slab, i) ? debug_lookup((void *)object) : NULL;
+        if(entry)
+            printf("    Object address: %p, allocated in: %.30s, line: %d\n", (void *)object, entry->filename, entry->fileline);
     }
-    printf("Total heap size: %zu B\n", heap_get_used_space() + heap_get_free_space());
-    printf("Bytes in use: %zu B\n", heap_get_used_space());
-    printf("Bytes free: %zu B\n", heap_get_free_space());
-    printf("Size of the largest empty block: %zu B\n", heap_get_largest_free_area());
-}
\ No newline at end of file
+}
+
+void heap_dump_debug_information(void) {
+    tcache_flush();
+    for(int i = 0; i < SHARDS_MAX; ++i) {
+        heap_lock(&shards[i]);
+        pthread_mutex_lock(&debug_mut);
+        for(struct block_meta *ptr = shard->heap; ptr; ptr = ptr->next)
+            dump_block(ptr);
+        if(shard == shards)
+            for(struct block_meta *ptr = mapped; ptr; ptr = ptr->next)
+                dump_block(ptr);
+        pthread_mutex_unlock(&debug_mut);
+        heap_unlock();
+    }
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    printf("Total heap size: %zu B\n", stats.used_space + stats.free_space);
+    printf("Bytes in use: %zu B\n", stats.used_space);
+    printf("Bytes free: %zu B\n", stats.free_space);
+    printf("Size of the largest empty block: %zu B\n", stats.largest_free_area);
+}
+
+void heap_dump_call_sites(void) {
+    //ONE LINE PER filename:fileline, NO WALK THROUGH THE BLOCKS
+    struct debug_site *sites;
+    size_t count = site_snapshot(&sites);
+    size_t total = 0;
+    printf("%-40s %10s %14s %14s\n", "Call site", "Blocks", "Live bytes", "Peak bytes");
+    for(size_t i = 0; i < count; ++i) {
+        char site[64];
+        snprintf(site, sizeof(site), "%.30s:%d", sites[i].filename, sites[i].fileline);
+        printf("%-40s %10zu %14zu %14zu\n", site, sites[i].count, sites[i].bytes, sites[i].peak);
+        total += sites[i].bytes;
+    }
+    printf("Live bytes from %zu call sites: %zu B\n", count, total);
+    if(sites)
+        munmap(sites, count * sizeof(struct debug_site));
+}
@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "custom_unistd.h"
+
+#define EXPORT __attribute__((visibility("default")))
+#define MALLOC_ALIGN    16      // Wyrównanie gwarantowane przez malloc z glibc na x86-64
+#define MALLOC_PAGE     4096
+#define ROUND_SIZE(SIZE) (((SIZE) + MALLOC_ALIGN - 1) & ~(size_t)(MALLOC_ALIGN - 1))
+
+// Biblioteka LD_PRELOAD: standardowe funkcje malloc na sterocie memmanager.c,
+// budowana z -DMEMMANAGER_PRELOAD (patrz README)
+
+void memory_init(void);
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static bool preload_ready = false;
+
+static void preload_init(void) {
+    memory_init();
+    preload_ready = heap_setup() == 0;
+}
+
+static bool preload_prepare(size_t size) {
+    pthread_once(&preload_once, preload_init);
+    if(!preload_ready || size > SIZE_MAX - MALLOC_ALIGN) {
+        errno = ENOMEM;
+        return false;
+    }
+    return true;
+}
+
+static void *preload_result(void *ptr) {
+    if(!ptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+static void *preload_memalign(size_t alignment, size_t size) {
+    //EVERY BLOCK SIZE IS ROUNDED, SO ALL HEADERS AND DATA STAY 16-BYTE ALIGNED
+    if(!preload_prepare(size))
+        return NULL;
+    size = size ? ROUND_SIZE(size) : MALLOC_ALIGN;
+    if(alignment <= MALLOC_ALIGN)
+        return preload_result(heap_malloc(size));
+    return preload_result(heap_memalign(alignment, size));
+}
+
+EXPORT void* malloc(size_t size) {
+    return preload_memalign(MALLOC_ALIGN, size);
+}
+
+EXPORT void free(void* ptr) {
+    if(ptr)
+        heap_free(ptr);
+}
+
+EXPORT void* calloc(size_t number, size_t size) {
+    if(size && number > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t count = number * size;
+    if(!preload_prepare(count))
+        return NULL;
+    return preload_result(heap_calloc(count ? ROUND_SIZE(count) : MALLOC_ALIGN, 1)); //clears only memory that may be dirty
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+    if(!ptr)
+        return malloc(size);
+    if(!size) {
+        heap_free(ptr);
+        return NULL;
+    }
+    if(!preload_prepare(size))
+        return NULL;
+    return preload_result(heap_realloc(ptr, ROUND_SIZE(size)));
+}
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if(!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *))
+        return EINVAL;
+    void *ptr = preload_memalign(alignment, size);
+    if(!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    if(!alignment || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return preload_memalign(alignment, size);
+}
+
+EXPORT void* memalign(size_t alignment, size_t size) {
+    if(alignment > SIZE_MAX / 2 + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t power = 1;
+    while(power < alignment) //glibc rounds a bad alignment up to a power of two
+        power <<= 1;
+    return preload_memalign(power, size);
+}
+
+EXPORT void* valloc(size_t size) {
+    return preload_memalign(MALLOC_PAGE, size);
+}
+
+EXPORT void* pvalloc(size_t size) {
+    if(size > SIZE_MAX - MALLOC_PAGE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return preload_memalign(MALLOC_PAGE, (size + MALLOC_PAGE - 1) & ~(size_t)(MALLOC_PAGE - 1));
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+    return ptr ? heap_get_block_size(ptr) : 0;
+}
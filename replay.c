@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "custom_unistd.h"
+
+#define MAX_THREADS     256     // Wątki śladu ponad ten limit dzielą wątek odtwarzania
+
+// Krok odtwarzania: obiekty śladu zamienione na kolejne identyfikatory
+struct step {
+    uint32_t in;        //obiekt zwalniany lub zmieniany, 0 - brak
+    uint32_t out;       //obiekt zwracany, 0 - brak
+    uint32_t thread;    //indeks wątku odtwarzania
+};
+
+// Adresy żywych obiektów śladu, adresowanie otwarte
+struct live_map {
+    uint64_t *keys;
+    uint32_t *ids;
+    size_t mask;
+};
+
+struct trace {
+    const struct heap_trace_record *records;
+    struct step *steps;
+    size_t count;
+    uint32_t objects;
+    int threads;
+    size_t resets;
+};
+
+struct replayer {
+    const struct trace *trace;
+    size_t begin;       //odcinek śladu między resetami sterty
+    size_t end;
+    int thread;         //-1 - wszystkie kroki w jednym wątku
+    bool wait;          //obiekty z innych wątków mogą jeszcze nie istnieć
+    size_t peak_heap;
+};
+
+static void **objects;
+static char failed_object;  //obiekt, którego alokacja się nie powiodła
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// NORMALIZATION: ADDRESSES REUSED OVER TIME BECOME UNIQUE OBJECT IDS
+//
+
+static size_t live_slot(const struct live_map *map, uint64_t key) {
+    size_t slot = (key >> 4) * 0x9E3779B97F4A7C15ULL & map->mask;
+    while(map->keys[slot] && map->keys[slot] != key)
+        slot = (slot + 1) & map->mask;
+    return slot;
+}
+
+static void live_put(struct live_map *map, uint64_t key, uint32_t id) {
+    size_t slot = live_slot(map, key);
+    map->keys[slot] = key;
+    map->ids[slot] = id;
+}
+
+static uint32_t live_take(struct live_map *map, uint64_t key) {
+    size_t slot = live_slot(map, key);
+    if(!map->keys[slot])
+        return 0;
+    uint32_t id = map->ids[slot];
+    //BACKWARD SHIFT KEEPS THE PROBE CHAINS WITHOUT TOMBSTONES
+    size_t hole = slot;
+    for(size_t next = (hole + 1) & map->mask; map->keys[next]; next = (next + 1) & map->mask) {
+        size_t home = (map->keys[next] >> 4) * 0x9E3779B97F4A7C15ULL & map->mask;
+        if(((next - home) & map->mask) >= ((next - hole) & map->mask)) {
+            map->keys[hole] = map->keys[next];
+            map->ids[hole] = map->ids[next];
+            hole = next;
+        }
+    }
+    map->keys[hole] = 0;
+    return id;
+}
+
+static int thread_index(uint32_t *tids, int *count, uint32_t tid) {
+    for(int i = 0; i < *count; ++i)
+        if(tids[i] == tid)
+            return i;
+    if(*count < MAX_THREADS) {
+        tids[*count] = tid;
+        return (*count)++;
+    }
+    return tid % MAX_THREADS;
+}
+
+static bool trace_load(const char *path, struct trace *trace) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct heap_trace_header)) {
+        fprintf(stderr, "%s: cannot read the trace\n", path);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return false;
+    const struct heap_trace_header *header = data;
+    if(memcmp(header->magic, HEAP_TRACE_MAGIC, sizeof(header->magic)) != 0 || header->record_size != sizeof(struct heap_trace_record)) {
+        fprintf(stderr, "%s: not a heap trace\n", path);
+        return false;
+    }
+    trace->records = (const struct heap_trace_record *)(header + 1);
+    trace->count = (st.st_size - sizeof(*header)) / sizeof(struct heap_trace_record);
+    trace->steps = calloc(trace->count + 1, sizeof(struct step));
+    trace->objects = 0;
+    trace->threads = 0;
+    trace->resets = 0;
+
+    struct live_map map;
+    size_t capacity = 64;
+    while(capacity < 2 * trace->count)
+        capacity <<= 1;
+    map.keys = calloc(capacity, sizeof(uint64_t));
+    map.ids = calloc(capacity, sizeof(uint32_t));
+    map.mask = capacity - 1;
+    uint32_t tids[MAX_THREADS];
+    if(!trace->steps || !map.keys || !map.ids)
+        return false;
+    for(size_t i = 0; i < trace->count; ++i) {
+        const struct heap_trace_record *record = &trace->records[i];
+        struct step *step = &trace->steps[i];
+        step->thread = thread_index(tids, &trace->threads, record->thread);
+        switch(record->op) {
+            case trace_reset:
+                memset(map.keys, 0, capacity * sizeof(uint64_t));
+                ++trace->resets;
+                break;
+            case trace_free:
+                step->in = live_take(&map, record->pointer);
+                break;
+            case trace_realloc:
+                step->in = live_take(&map, record->pointer);
+                if(record->size && record->result) {
+                    step->out = ++trace->objects;
+                    live_put(&map, record->result, step->out);
+                }
+                else if(record->size && step->in) //failed, the old object stays
+                    live_put(&map, record->pointer, step->in);
+                break;
+            default:
+                if(record->result) {
+                    step->out = ++trace->objects;
+                    live_put(&map, record->result, step->out); //an address still live was lost to a reset
+                }
+        }
+    }
+    free(map.keys);
+    free(map.ids);
+    objects = calloc(trace->objects + 1, sizeof(void *));
+    return objects != NULL;
+}
+
+//
+// REPLAY
+//
+
+static void *object_get(uint32_t id, bool wait) {
+    void *ptr = __atomic_load_n(&objects[id], __ATOMIC_ACQUIRE);
+    while(!ptr && wait) {
+        sched_yield();
+        ptr = __atomic_load_n(&objects[id], __ATOMIC_ACQUIRE);
+    }
+    return ptr == &failed_object ? NULL : ptr;
+}
+
+static void object_set(uint32_t id, void *ptr) {
+    __atomic_store_n(&objects[id], ptr ? ptr : &failed_object, __ATOMIC_RELEASE);
+}
+
+static void replay_step(const struct heap_trace_record *record, const struct step *step, bool wait) {
+    size_t alignment = record->alignment_log2 ? (size_t)1 << record->alignment_log2 : 0;
+    void *ptr;
+    switch(record->op) {
+        case trace_malloc:
+            ptr = alignment ? heap_memalign(alignment, record->size) : heap_malloc(record->size);
+            break;
+        case trace_calloc:
+            if(alignment) {
+                ptr = heap_memalign(alignment, record->size);
+                if(ptr)
+                    memset(ptr, 0, record->size);
+            }
+            else
+                ptr = heap_calloc(record->size, 1);
+            break;
+        case trace_realloc:
+            if(!step->in) { //allocated before the trace started
+                ptr = heap_malloc(record->size);
+                break;
+            }
+            ptr = object_get(step->in, wait);
+            if(!ptr) //lost to a failed allocation, the result fails as well
+                break;
+            ptr = alignment ? heap_realloc_aligned(ptr, record->size) : heap_realloc(ptr, record->size);
+            if(!step->out) {
+                if(record->size && ptr) //failed in the trace only
+                    object_set(step->in, ptr);
+                return;
+            }
+            break;
+        case trace_free:
+            if(step->in)
+                heap_free(object_get(step->in, wait));
+            return;
+        default:
+            return;
+    }
+    if(step->out)
+        object_set(step->out, ptr);
+}
+
+static void *replay_run(void *arg) {
+    struct replayer *replayer = arg;
+    const struct trace *trace = replayer->trace;
+    for(size_t i = replayer->begin; i < replayer->end; ++i) {
+        if(replayer->thread >= 0 && trace->steps[i].thread != (uint32_t)replayer->thread)
+            continue;
+        replay_step(&trace->records[i], &trace->steps[i], replayer->wait);
+        size_t size = heap_get_heap_size();
+        if(size > replayer->peak_heap)
+            replayer->peak_heap = size;
+    }
+    return NULL;
+}
+
+static size_t replay_segment(const struct trace *trace, size_t begin, size_t end, bool threaded) {
+    //RECORDED THREADS REPLAY IN PARALLEL, EACH WAITS ONLY FOR OBJECTS OF EARLIER RECORDS
+    struct replayer replayers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    int count = threaded ? trace->threads : 1;
+    size_t peak = 0;
+    for(int i = 0; i < count; ++i) {
+        replayers[i] = (struct replayer){ trace, begin, end, threaded ? i : -1, threaded, 0 };
+        if(threaded)
+            pthread_create(&ids[i], NULL, replay_run, &replayers[i]);
+        else
+            replay_run(&replayers[i]);
+    }
+    for(int i = 0; i < count; ++i) {
+        if(threaded)
+            pthread_join(ids[i], NULL);
+        if(replayers[i].peak_heap > peak)
+            peak = replayers[i].peak_heap;
+    }
+    return peak;
+}
+
+int main(int argc, char **argv)
+{
+    bool threaded = false;
+    const char *path = NULL;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-t") == 0)
+            threaded = true;
+        else
+            path = argv[i];
+    }
+    if(!path) {
+        fprintf(stderr, "usage: %s [-t] trace\n", argv[0]);
+        return 2;
+    }
+    struct trace trace;
+    if(!trace_load(path, &trace))
+        return 1;
+    if(heap_setup() != 0) {
+        fprintf(stderr, "heap_setup failed\n");
+        return 1;
+    }
+
+    size_t peak = 0, begin = 0;
+    uint64_t start = now_ns();
+    for(size_t i = 0; i <= trace.count; ++i) {
+        if(i < trace.count && trace.records[i].op != trace_reset)
+            continue;
+        size_t segment_peak = replay_segment(&trace, begin, i, threaded);
+        if(segment_peak > peak)
+            peak = segment_peak;
+        if(i < trace.count)
+            heap_setup_reserve(trace.records[i].size);
+        begin = i + 1;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    struct heap_stats stats;
+    heap_get_stats(&stats);
+    uint64_t recorded = trace.count ? trace.records[trace.count - 1].timestamp - trace.records[0].timestamp : 0;
+    printf("trace: %zu records, %u objects, %d threads, %zu resets, recorded in %.3f ms\n",
+        trace.count, trace.objects, trace.threads, trace.resets, recorded / 1e6);
+    printf("replay (%s): %.3f ms, %.0f ops/s, %.1f ns/op\n", threaded ? "per-thread" : "single-threaded",
+        elapsed / 1e6, trace.count / (elapsed / 1e9), trace.count ? (double)elapsed / trace.count : 0.0);
+    printf("peak heap size: %zu KB\n", peak / 1024);
+    printf("at end: used %zu B in %llu blocks, free %zu B in %llu gaps, largest free area %zu B, fragmentation %.1f%%\n",
+        stats.used_space, (unsigned long long)stats.used_blocks_count, stats.free_space,
+        (unsigned long long)heap_get_free_gaps_count(), heap_get_largest_free_area(),
+        stats.free_space ? 100.0 * (1.0 - (double)heap_get_largest_free_area() / stats.free_space) : 0.0);
+    return 0;
+}